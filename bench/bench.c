@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Benchmark driver: generates images of increasing size and shape with genfs,
+ * times chkfs on each and prints throughput and peak memory.
+ *
+ * Usage: bench [-n runs] [-o dir] [-c chkfs] [-g genfs] [-- chkfs options]
+ */
+
+struct preset {
+    const char *name;
+    const char *blocks;
+    const char *inodes;
+    const char *depth;
+    const char *fanout;
+    const char *dist;
+};
+
+// From the size of the test image up to the largest inode count xv6 can name
+struct preset presets[] = {
+    { "tiny",     "2000",    "200",   "2",  "3",    "mixed" },
+    { "wide",     "65536",   "8192",  "1",  "2000", "small" },
+    { "deep",     "65536",   "4096",  "11", "2",    "mixed" },
+    { "indirect", "262144",  "1024",  "2",  "4",    "indirect" },
+    { "large",    "1048576", "65536", "3",  "16",   "mixed" },
+};
+
+#define NPRESETS (sizeof(presets) / sizeof(presets[0]))
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs argv with stdout sent to /dev/null and waits for it.
+ * Fills ru with the child's resource usage. Returns its exit status or -1.
+ */
+int run(char *const argv[], struct rusage *ru) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) dup2(fd, STDOUT_FILENO);
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    while (wait4(pid, &status, 0, ru) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Reads the block and inode counts out of an image's superblock.
+ */
+int image_size(const char *path, unsigned *blocks, unsigned *inodes) {
+    unsigned sb[4];  // magic, size, nblocks, ninodes
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, sb, sizeof(sb), 1024);
+    close(fd);
+    if (n != sizeof(sb)) return -1;
+    *blocks = sb[1];
+    *inodes = sb[3];
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *chkfs = "./chkfs";
+    const char *genfs = "./bench/genfs";
+    const char *dir = "/tmp";
+    int runs = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:c:g:")) != -1) {
+        switch (opt) {
+        case 'n': runs = atoi(optarg); break;
+        case 'o': dir = optarg; break;
+        case 'c': chkfs = optarg; break;
+        case 'g': genfs = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n runs] [-o dir] [-c chkfs] [-g genfs] [-- chkfs options]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+
+    // chkfs argv: the binary, pass-through options, the image
+    int nextra = argc - optind;
+    char **cargv = calloc(nextra + 3, sizeof(char *));
+    if (!cargv) return 1;
+    cargv[0] = (char *)chkfs;
+    memcpy(cargv + 1, argv + optind, nextra * sizeof(char *));
+
+    printf("%-9s %9s %7s %10s %14s %12s %10s\n",
+           "image", "blocks", "inodes", "seconds", "blocks/s", "inodes/s", "RSS KiB");
+
+    int failed = 0;
+    for (size_t i = 0; i < NPRESETS; i++) {
+        struct preset *p = &presets[i];
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/chkfs-bench-%s.img", dir, p->name);
+
+        char *gargv[] = { (char *)genfs, "-b", (char *)p->blocks, "-i", (char *)p->inodes,
+                          "-d", (char *)p->depth, "-f", (char *)p->fanout, "-z", (char *)p->dist,
+                          path, NULL };
+        struct rusage ru;
+        if (run(gargv, &ru) != 0) {
+            fprintf(stderr, "%s: failed to generate %s\n", argv[0], path);
+            failed = 1;
+            continue;
+        }
+
+        unsigned blocks, inodes;
+        if (image_size(path, &blocks, &inodes) < 0) {
+            fprintf(stderr, "%s: cannot read %s\n", argv[0], path);
+            failed = 1;
+            continue;
+        }
+
+        // Best of runs; peak RSS is the largest any run reached
+        cargv[nextra + 1] = path;
+        double best = 0;
+        long rss = 0;
+        int status = 0;
+        for (int r = 0; r < runs && status == 0; r++) {
+            double t = now_seconds();
+            status = run(cargv, &ru);
+            t = now_seconds() - t;
+            if (r == 0 || t < best) best = t;
+            if (ru.ru_maxrss > rss) rss = ru.ru_maxrss;
+        }
+        if (status != 0) {
+            fprintf(stderr, "%s: chkfs reported %s inconsistent (status %d)\n", argv[0], path, status);
+            failed = 1;
+        }
+
+        printf("%-9s %9u %7u %10.6f %14.0f %12.0f %10ld\n",
+               p->name, blocks, inodes, best, blocks / best, inodes / best, rss);
+        fflush(stdout);
+        unlink(path);
+    }
+
+    free(cargv);
+    return failed;
+}
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#define stat xv6_stat  // avoid clash with host struct stat
+#include "kernel/types.h"
+#include "kernel/fs.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+
+#ifndef static_assert
+#define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
+#endif
+
+// Generates a consistent xv6 image of any size for benchmarking chkfs.
+// The allocation logic is mkfs's (ialloc, iappend, balloc); the layout is
+// computed from the command line instead of FSSIZE and NINODES, file data
+// is left as holes, and the inode table and bitmap are written once at the end.
+//
+// Disk layout:
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+
+uint fssize = FSSIZE;
+uint ninodes = 200;
+int depth = 2;
+int fanout = 4;
+int dist = 1;
+uint seed = 1;
+
+int nbitmap;
+int ninodeblocks;
+int nlog = LOGSIZE;
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nblocks;  // Number of data blocks
+
+int fsfd;
+struct superblock sb;
+struct dinode *itab;  // the inode table, written out at the end
+uint freeinode = 1;
+uint freeblock;
+
+uint *dirs;   // every directory, in creation order
+uint ndirs;
+uint nfiles;
+
+uint balloc1(void);
+void balloc(int);
+void wsect(uint, void*);
+void rsect(uint sec, void *buf);
+uint ialloc(ushort type);
+void iappend(uint inum, void *p, int n);
+void iextend(uint inum, uint size);
+void dirlink(uint dir, char *name, uint inum);
+uint makedir(uint parent, char *name);
+uint filesize(void);
+void die(const char *);
+
+// convert to riscv byte order
+ushort
+xshort(ushort x)
+{
+  ushort y;
+  uchar *a = (uchar*)&y;
+  a[0] = x;
+  a[1] = x >> 8;
+  return y;
+}
+
+uint
+xint(uint x)
+{
+  uint y;
+  uchar *a = (uchar*)&y;
+  a[0] = x;
+  a[1] = x >> 8;
+  a[2] = x >> 16;
+  a[3] = x >> 24;
+  return y;
+}
+
+// xorshift32: the same seed gives the same image
+uint
+rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+void
+usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-b blocks] [-i inodes] [-d depth] [-f fanout] "
+          "[-z small|mixed|indirect] [-r seed] fs.img\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int opt;
+  uint i, root, level_start, level_end, size, need;
+  char buf[BSIZE], name[DIRSIZ];
+
+  static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
+
+  while((opt = getopt(argc, argv, "b:i:d:f:z:r:")) != -1){
+    switch(opt){
+    case 'b': fssize = strtoul(optarg, 0, 0); break;
+    case 'i': ninodes = strtoul(optarg, 0, 0); break;
+    case 'd': depth = atoi(optarg); break;
+    case 'f': fanout = atoi(optarg); break;
+    case 'r': seed = strtoul(optarg, 0, 0); break;
+    case 'z':
+      if(strcmp(optarg, "small") == 0) dist = 0;
+      else if(strcmp(optarg, "mixed") == 0) dist = 1;
+      else if(strcmp(optarg, "indirect") == 0) dist = 2;
+      else usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if(optind + 1 != argc || depth < 0 || fanout < 1 || seed == 0)
+    usage(argv[0]);
+
+  // Directory entries hold a ushort inode number
+  if(ninodes < 2 || ninodes > 65536){
+    fprintf(stderr, "genfs: inodes must be between 2 and 65536\n");
+    exit(1);
+  }
+
+  // chkfs reads inodes 1..ninodes but counts only the blocks that
+  // ninodes rounds up to, so keep the last inode off a block boundary.
+  // The bitmap is rounded up rather than given mkfs's +1, which leaves
+  // an unreferenced block when the size divides evenly.
+  if(ninodes % IPB == 0)
+    ninodes--;
+  nbitmap = (fssize + BPB - 1) / BPB;
+  ninodeblocks = ninodes / IPB + 1;
+  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  if(fssize <= nmeta + 1){
+    fprintf(stderr, "genfs: %u blocks is too small for %u inodes\n", fssize, ninodes);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
+
+  fsfd = open(argv[optind], O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if(fsfd < 0)
+    die(argv[optind]);
+
+  // Data blocks stay holes; only metadata is ever written
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0)
+    die("ftruncate");
+
+  itab = calloc(ninodeblocks * IPB, sizeof(struct dinode));
+  dirs = malloc(ninodes * sizeof(uint));
+  if(itab == 0 || dirs == 0)
+    die("malloc");
+
+  sb.magic = FSMAGIC;
+  sb.size = xint(fssize);
+  sb.nblocks = xint(nblocks);
+  sb.ninodes = xint(ninodes);
+  sb.nlog = xint(nlog);
+  sb.logstart = xint(2);
+  sb.inodestart = xint(2+nlog);
+  sb.bmapstart = xint(2+nlog+ninodeblocks);
+
+  freeblock = nmeta;     // the first free block that we can allocate
+
+  memset(buf, 0, sizeof(buf));
+  memmove(buf, &sb, sizeof(sb));
+  wsect(1, buf);
+
+  root = makedir(0, 0);
+  assert(root == ROOTINO);
+
+  // The tree: every directory of a level gets fanout subdirectories,
+  // leaving at least half of the inodes for files
+  level_start = 0;
+  for(int d = 0; d < depth; d++){
+    level_end = ndirs;
+    for(i = level_start; i < level_end; i++){
+      for(int f = 0; f < fanout; f++){
+        if(freeinode >= ninodes / 2 || freeblock + 2 >= fssize)
+          goto files;
+        snprintf(name, DIRSIZ, "d%d", f);
+        makedir(dirs[i], name);
+      }
+    }
+    level_start = level_end;
+  }
+
+files:
+  // Files go round-robin over the directories until inodes or blocks run out
+  while(freeinode < ninodes){
+    size = filesize();
+    need = (size + BSIZE - 1) / BSIZE;
+    if(need > NDIRECT)
+      need++;    // the indirect block
+    if(freeblock + need + 1 >= fssize)
+      break;     // +1 for a directory block
+    uint dir = dirs[nfiles % ndirs];
+    uint inum = ialloc(T_FILE);
+    snprintf(name, DIRSIZ, "f%u", nfiles++);
+    dirlink(dir, name, inum);
+    iextend(inum, size);
+  }
+
+  for(i = 0; i < ninodeblocks; i++)
+    wsect(xint(sb.inodestart) + i, (char*)itab + i * BSIZE);
+  balloc(freeblock);
+
+  printf("genfs: %u blocks, %u inodes, %u directories, %u files, %u blocks used\n",
+         fssize, ninodes, ndirs, nfiles, freeblock);
+  exit(0);
+}
+
+// Picks a file size from the distribution: small files fit in the
+// direct blocks, indirect files need the indirect block, and mixed is
+// mostly small with a tail of large files.
+uint
+filesize(void)
+{
+  uint r = rnd() % 100;
+
+  if(dist == 0 || (dist == 1 && r < 80))
+    return rnd() % (4 * BSIZE + 1);
+  if(dist == 1 && r < 95)
+    return rnd() % (NDIRECT * BSIZE + 1);
+  return NDIRECT * BSIZE + 1 + rnd() % (NINDIRECT * BSIZE);
+}
+
+uint
+makedir(uint parent, char *name)
+{
+  struct dirent de;
+  uint inum = ialloc(T_DIR);
+
+  if(parent == 0)
+    parent = inum;  // the root is its own parent
+  else {
+    dirlink(parent, name, inum);
+    itab[parent].nlink = xshort(xshort(itab[parent].nlink) + 1);
+  }
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strcpy(de.name, ".");
+  iappend(inum, &de, sizeof(de));
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(parent);
+  strcpy(de.name, "..");
+  iappend(inum, &de, sizeof(de));
+
+  dirs[ndirs++] = inum;
+  return inum;
+}
+
+void
+dirlink(uint dir, char *name, uint inum)
+{
+  struct dirent de;
+  size_t len = strlen(name);
+
+  // The name field is DIRSIZ bytes and not terminated when full
+  if(len > DIRSIZ){
+    fprintf(stderr, "genfs: name %s is too long\n", name);
+    exit(1);
+  }
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  memcpy(de.name, name, len);
+  iappend(dir, &de, sizeof(de));
+}
+
+void
+wsect(uint sec, void *buf)
+{
+  if(pwrite(fsfd, buf, BSIZE, (off_t)sec * BSIZE) != BSIZE)
+    die("write");
+}
+
+void
+rsect(uint sec, void *buf)
+{
+  if(pread(fsfd, buf, BSIZE, (off_t)sec * BSIZE) != BSIZE)
+    die("read");
+}
+
+uint
+ialloc(ushort type)
+{
+  uint inum = freeinode++;
+  struct dinode *din = &itab[inum];
+
+  assert(inum < ninodes);
+  bzero(din, sizeof(*din));
+  din->type = xshort(type);
+  din->nlink = xshort(1);
+  din->size = xint(0);
+  return inum;
+}
+
+uint
+balloc1(void)
+{
+  if(freeblock >= fssize){
+    fprintf(stderr, "genfs: out of blocks\n");
+    exit(1);
+  }
+  return freeblock++;
+}
+
+// Marks the first used blocks allocated, across as many bitmap blocks as it takes
+void
+balloc(int used)
+{
+  uchar buf[BSIZE];
+  int b, i;
+
+  assert(used <= nbitmap * BPB);
+  for(b = 0; b < nbitmap; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b * BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    wsect(xint(sb.bmapstart) + b, buf);
+  }
+}
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+void
+iappend(uint inum, void *xp, int n)
+{
+  char *p = (char*)xp;
+  uint fbn, off, n1;
+  struct dinode *din = &itab[inum];
+  char buf[BSIZE];
+  uint indirect[NINDIRECT];
+  uint x;
+
+  off = xint(din->size);
+  while(n > 0){
+    fbn = off / BSIZE;
+    assert(fbn < MAXFILE);
+    if(fbn < NDIRECT){
+      if(xint(din->addrs[fbn]) == 0){
+        din->addrs[fbn] = xint(balloc1());
+      }
+      x = xint(din->addrs[fbn]);
+    } else {
+      if(xint(din->addrs[NDIRECT]) == 0){
+        din->addrs[NDIRECT] = xint(balloc1());
+      }
+      rsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+      if(indirect[fbn - NDIRECT] == 0){
+        indirect[fbn - NDIRECT] = xint(balloc1());
+        wsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+      }
+      x = xint(indirect[fbn-NDIRECT]);
+    }
+    n1 = min(n, (fbn + 1) * BSIZE - off);
+    rsect(x, buf);
+    bcopy(p, buf + off - (fbn * BSIZE), n1);
+    wsect(x, buf);
+    n -= n1;
+    off += n1;
+    p += n1;
+  }
+  din->size = xint(off);
+}
+
+// Grows an empty file to size bytes without writing its data, so the
+// blocks stay holes in the image. The indirect block is written once.
+void
+iextend(uint inum, uint size)
+{
+  struct dinode *din = &itab[inum];
+  uint indirect[NINDIRECT];
+  uint fbn, nb = (size + BSIZE - 1) / BSIZE;
+
+  assert(xint(din->size) == 0 && nb <= MAXFILE);
+  for(fbn = 0; fbn < nb && fbn < NDIRECT; fbn++)
+    din->addrs[fbn] = xint(balloc1());
+  if(nb > NDIRECT){
+    din->addrs[NDIRECT] = xint(balloc1());
+    bzero(indirect, sizeof(indirect));
+    for(; fbn < nb; fbn++)
+      indirect[fbn - NDIRECT] = xint(balloc1());
+    wsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+  }
+  din->size = xint(size);
+}
+
+void
+die(const char *s)
+{
+  perror(s);
+  exit(1);
+}
@@ -1,24 +1,498 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 #define stat xv6_stat //this was causing conflict bc of the 2 stat defs
 
 #include "kernel/types.h"
 #include "kernel/fs.h"
 #include "kernel/stat.h"
 
+#undef stat // from here on struct stat is the host's again, for fstat()
+
 #define SUPERBLOCK 1
 
-// Maximum number of directory entries that can fit in all direct + indirect blocks in a directory inode
-// To reduce duplicate code
-#define MAX_DIRENT_COUNT (BSIZE / sizeof(struct dirent) * (NDIRECT + NINDIRECT))
 
+/*
+ * What a run cost, for --stats and the JSON summary. Time is split into the
+ * phases of a check; reads and bytes are counted wherever the image is read.
+ */
+enum { PHASE_SUPERBLOCK, PHASE_INODE, PHASE_DIRECTORY, PHASE_BITMAP, PHASE_REFERENCE, PHASE_REPAIR, PHASE_FINGERPRINT, NPHASES };
+
+const char *phase_names[NPHASES] = { "superblock", "inode", "directory", "bitmap", "reference", "repair", "fingerprint" };
+
+struct run_stats {
+    double phase[NPHASES];      // seconds spent in each phase
+    unsigned long bytes_read;
+    unsigned long syscalls;
+    uint fixes;                 // changes made by -y
+    unsigned long bits_flipped; // in the bitmap, by --rebuild-bitmap
+    long blocks_written;        // by -y or --rebuild-bitmap, -1 if that failed
+    unsigned long spill_runs;   // sorted runs written under --mem-limit
+    unsigned long spill_bytes;
+};
+
+struct run_stats stats = { { 0 }, 0, 0, 0, 0, 0, 0, 0 };  // Global run statistics
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void count_io(unsigned long bytes, unsigned long calls) {
+    __atomic_fetch_add(&stats.bytes_read, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.syscalls, calls, __ATOMIC_RELAXED);
+}
+
+/*
+ * Per-run arena: a bump allocator over fixed-size chunks. Everything the scan
+ * keeps (indirect blocks copied by the pread backend, directory entries) is
+ * carved out of a worker's arena and released in one go with the model, so
+ * there is no per-object malloc and pointers handed out never move.
+ */
+#define ARENA_CHUNK (64 * BSIZE)
+
+struct arena {
+    char **chunks;
+    uint nchunks, chunks_cap;
+    char *cur, *end;        // free space left in the last chunk
+};
+
+/*
+ * Returns room for size bytes, 8-byte aligned, or NULL if memory ran out.
+ * Requests bigger than a chunk get a chunk of their own.
+ */
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if ((size_t)(a->end - a->cur) < size) {
+        if (a->nchunks == a->chunks_cap) {
+            uint ncap = a->chunks_cap ? a->chunks_cap * 2 : 16;
+            char **c = realloc(a->chunks, ncap * sizeof(char *));
+            if (!c) return NULL;
+            a->chunks = c;
+            a->chunks_cap = ncap;
+        }
+        size_t csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        char *chunk = malloc(csize);
+        if (!chunk) return NULL;
+        a->chunks[a->nchunks++] = chunk;
+        a->cur = chunk;
+        a->end = chunk + csize;
+    }
+    void *p = a->cur;
+    a->cur += size;
+    return p;
+}
+
+/*
+ * Grows the most recent allocation p from oldsize to newsize bytes: in place
+ * if the chunk has room, else by moving it to a fresh chunk.
+ * Returns the (possibly moved) allocation, or NULL if memory ran out.
+ */
+void *arena_grow(struct arena *a, void *p, size_t oldsize, size_t newsize) {
+    oldsize = (oldsize + 7) & ~(size_t)7;
+    newsize = (newsize + 7) & ~(size_t)7;
+    if (p && (char *)p + oldsize == a->cur && (size_t)(a->end - (char *)p) >= newsize) {
+        a->cur = (char *)p + newsize;
+        return p;
+    }
+    void *q = arena_alloc(a, newsize);
+    if (q && p) memcpy(q, p, oldsize);
+    return q;
+}
+
+void arena_free(struct arena *a) {
+    for (uint i = 0; i < a->nchunks; i++) {
+        free(a->chunks[i]);
+    }
+    free(a->chunks);
+    memset(a, 0, sizeof(*a));
+}
+
+/*
+ * Whole blocks by block number: open addressing on the block number, with
+ * the copies carved out of an arena. Holds the blocks a stream keeps and
+ * the blocks a repair changes.
+ */
+struct table_slot {
+    uint blockno;
+    char *data;             // NULL if the slot is empty
+};
+
+struct block_table {
+    struct table_slot *slots;
+    uint cap, n;
+    struct arena arena;     // the block copies
+};
+
+struct table_slot *btab_slot(struct table_slot *slots, uint cap, uint blockno) {
+    uint i = (blockno * 2654435761u) & (cap - 1);
+    while (slots[i].data && slots[i].blockno != blockno) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+/*
+ * Returns the table's copy of a block, or NULL if it has none.
+ */
+char *btab_lookup(const struct block_table *t, uint blockno) {
+    return t->cap ? btab_slot(t->slots, t->cap, blockno)->data : NULL;
+}
+
+/*
+ * Returns room for a block in the table, uninitialised if it is new.
+ * Returns NULL if memory ran out.
+ */
+char *btab_insert(struct block_table *t, uint blockno) {
+    char *p = btab_lookup(t, blockno);
+    if (p) return p;
+
+    if (2 * (t->n + 1) > t->cap) {
+        uint ncap = t->cap ? t->cap * 2 : 64;
+        struct table_slot *slots = calloc(ncap, sizeof(struct table_slot));
+        if (!slots) {
+            perror("malloc");
+            return NULL;
+        }
+        for (uint i = 0; i < t->cap; i++) {
+            if (t->slots[i].data) *btab_slot(slots, ncap, t->slots[i].blockno) = t->slots[i];
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->cap = ncap;
+    }
+
+    p = arena_alloc(&t->arena, BSIZE);
+    if (!p) {
+        perror("malloc");
+        return NULL;
+    }
+    *btab_slot(t->slots, t->cap, blockno) = (struct table_slot){ blockno, p };
+    t->n++;
+    return p;
+}
+
+void btab_free(struct block_table *t) {
+    free(t->slots);
+    arena_free(&t->arena);
+    memset(t, 0, sizeof(*t));
+}
+
+/*
+ * The image being checked. Regular files are mapped read-only and blocks are
+ * handed out as views into the mapping; anything that can't be mapped (block
+ * devices, or --no-mmap) falls back to pread(). A stream (chkfs -) is read
+ * once up front and the blocks the check needs are kept in a table. With
+ * pread, blocks fetched ahead of time by batch_read are kept in a table too.
+ * Blocks in the overlay (the log, with --replay-log) hide the image's own.
+ */
+struct image {
+    int fd;
+    const char *map;    // NULL when using the pread backend
+    off_t size;         // bytes in the mapping, or read from the stream
+    int stream;         // blocks come from the table below
+    struct block_table kept;
+    struct block_table fetched;  // read by batch_read, used in place by bview
+    struct block_table overlay;  // logged blocks, by destination; empty unless --replay-log
+};
+
+struct image img = { -1, NULL, 0, 0, { NULL, 0, 0, { NULL, 0, 0, NULL, NULL } },
+                     { NULL, 0, 0, { NULL, 0, 0, NULL, NULL } },
+                     { NULL, 0, 0, { NULL, 0, 0, NULL, NULL } } };  // Global image
+
+/*
+ * Opens the image, for writing too if it is to be repaired, and maps it if possible.
+ * Returns 0 on success or -1 on error with errno set.
+ */
+int image_open(const char *path, int use_mmap, int writable) {
+    img.fd = open(path, writable ? O_RDWR : O_RDONLY);
+    count_io(0, 1);
+    if (img.fd < 0) return -1;
+
+    struct stat st;
+    if (!use_mmap) return 0;  // pread backend
+    count_io(0, 1);
+    if (fstat(img.fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 0;
+    }
+
+    count_io(0, 1);
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, img.fd, 0);
+    if (p != MAP_FAILED) {
+        img.map = p;
+        img.size = st.st_size;
+    }
+    return 0;
+}
+
+void image_close(void) {
+    if (img.map) munmap((void *)img.map, img.size);
+    if (img.fd >= 0 && !img.stream) close(img.fd);
+    btab_free(&img.kept);
+    btab_free(&img.fetched);
+    btab_free(&img.overlay);
+    img.map = NULL;
+    img.fd = -1;
+}
+
+/*
+ * Block cache in front of the pread backend. Slots are kept on an LRU list
+ * (head is the most recently used) and found through a chained hash on the
+ * block number. Misses inside a readahead region pull in the following
+ * blocks of that region with the same pread.
+ */
+#define CACHE_DEFAULT_BLOCKS 1024
+#define CACHE_MAX_RA_REGIONS 4
+#define CACHE_RA_BLOCKS 32
+
+struct cache_slot {
+    uint bnum;
+    int prev, next;         // LRU list
+    int hnext;              // hash chain
+};
+
+struct block_cache {
+    uint nslots;            // 0 disables the cache
+    uint nused;
+    char *data;             // nslots * BSIZE
+    struct cache_slot *slots;
+    int *hash;
+    uint hmask;
+    int head, tail;
+
+    uint ra_start[CACHE_MAX_RA_REGIONS], ra_end[CACHE_MAX_RA_REGIONS];
+    int nra;
+
+    unsigned long hits, misses, readahead;
+};
+
+struct block_cache cache = { 0 };  // Global cache
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;  // Scan threads share the cache
+
+/*
+ * Sizes the cache. Returns 0 on success or -1 if memory ran out.
+ */
+int cache_init(uint nslots) {
+    if (nslots == 0) return 0;
+
+    uint nbuckets = 1;
+    while (nbuckets < 2 * nslots) nbuckets *= 2;
+
+    cache.data = malloc((size_t)nslots * BSIZE);
+    cache.slots = malloc(nslots * sizeof(struct cache_slot));
+    cache.hash = malloc(nbuckets * sizeof(int));
+    if (!cache.data || !cache.slots || !cache.hash) {
+        perror("malloc");
+        return -1;
+    }
+    for (uint i = 0; i < nbuckets; i++) {
+        cache.hash[i] = -1;
+    }
+    cache.nslots = nslots;
+    cache.hmask = nbuckets - 1;
+    cache.head = cache.tail = -1;
+    return 0;
+}
+
+void cache_free(void) {
+    free(cache.data);
+    free(cache.slots);
+    free(cache.hash);
+    memset(&cache, 0, sizeof(cache));
+}
+
+static void lru_unlink(int i) {
+    struct cache_slot *s = &cache.slots[i];
+    if (s->prev >= 0) cache.slots[s->prev].next = s->next; else cache.head = s->next;
+    if (s->next >= 0) cache.slots[s->next].prev = s->prev; else cache.tail = s->prev;
+}
+
+static void lru_push_front(int i) {
+    struct cache_slot *s = &cache.slots[i];
+    s->prev = -1;
+    s->next = cache.head;
+    if (cache.head >= 0) cache.slots[cache.head].prev = i;
+    cache.head = i;
+    if (cache.tail < 0) cache.tail = i;
+}
+
+static int cache_lookup(uint bnum) {
+    for (int i = cache.hash[bnum & cache.hmask]; i >= 0; i = cache.slots[i].hnext) {
+        if (cache.slots[i].bnum == bnum) return i;
+    }
+    return -1;
+}
+
+/*
+ * Takes a free slot, or evicts the least recently used one, and files it
+ * under bnum. Returns the slot index.
+ */
+static int cache_insert(uint bnum) {
+    int i;
+    if (cache.nused < cache.nslots) {
+        i = cache.nused++;
+    } else {
+        i = cache.tail;
+        lru_unlink(i);
+        int *pp = &cache.hash[cache.slots[i].bnum & cache.hmask];
+        while (*pp != i) pp = &cache.slots[*pp].hnext;
+        *pp = cache.slots[i].hnext;
+    }
+    cache.slots[i].bnum = bnum;
+    cache.slots[i].hnext = cache.hash[bnum & cache.hmask];
+    cache.hash[bnum & cache.hmask] = i;
+    lru_push_front(i);
+    return i;
+}
+
+/*
+ * Registers a region that is read front to back, so misses in it read ahead.
+ */
+void cache_add_readahead(uint start, uint nblocks) {
+    if (cache.nra == CACHE_MAX_RA_REGIONS) return;
+    cache.ra_start[cache.nra] = start;
+    cache.ra_end[cache.nra] = start + nblocks;
+    cache.nra++;
+}
+
+/*
+ * How many blocks to fetch for a miss on bnum: 1 normally, more inside a
+ * readahead region (never past its end or into blocks already cached).
+ */
+static uint cache_ra_span(uint bnum) {
+    for (int r = 0; r < cache.nra; r++) {
+        if (bnum < cache.ra_start[r] || bnum >= cache.ra_end[r]) continue;
+
+        uint n = cache.ra_end[r] - bnum;
+        if (n > CACHE_RA_BLOCKS) n = CACHE_RA_BLOCKS;
+        if (n > cache.nslots / 2) n = cache.nslots / 2;
+        for (uint k = 1; k < n; k++) {
+            if (cache_lookup(bnum + k) >= 0) return k;
+        }
+        return n ? n : 1;
+    }
+    return 1;
+}
+
+/*
+ * Reads block bnum into buf through the cache.
+ * Returns 0 on success or -1 on error.
+ */
+int cache_read(uint bnum, void *buf) {
+    int i = cache_lookup(bnum);
+    if (i >= 0) {
+        cache.hits++;
+        lru_unlink(i);
+        lru_push_front(i);
+        memcpy(buf, cache.data + (size_t)i * BSIZE, BSIZE);
+        return 0;
+    }
+    cache.misses++;
+
+    static char rabuf[CACHE_RA_BLOCKS * BSIZE];
+    uint n = cache_ra_span(bnum);
+    ssize_t got = pread(img.fd, rabuf, (size_t)n * BSIZE, (off_t)bnum * BSIZE);
+    count_io(got > 0 ? got : 0, 1);
+    if (got < BSIZE) return -1;
+
+    n = got / BSIZE;
+    // Insert the readahead blocks first so the requested block ends up most recent
+    for (uint k = n; k-- > 0; ) {
+        i = cache_insert(bnum + k);
+        memcpy(cache.data + (size_t)i * BSIZE, rabuf + (size_t)k * BSIZE, BSIZE);
+    }
+    cache.readahead += n - 1;
+    memcpy(buf, rabuf, BSIZE);
+    return 0;
+}
+
+/*
+ * Tells the kernel how a run of blocks is about to be read (MADV_SEQUENTIAL,
+ * MADV_WILLNEED, ...). For the pread backend a sequential region turns on
+ * readahead in the block cache instead.
+ */
+void image_advise(uint start, uint nblocks, int advice) {
+    if (!img.map) {
+        if (advice == MADV_SEQUENTIAL) cache_add_readahead(start, nblocks);
+        return;
+    }
+
+    off_t off = (off_t)start * BSIZE;
+    off_t len = (off_t)nblocks * BSIZE;
+    if (off >= img.size) return;
+    if (off + len > img.size) len = img.size - off;
+
+    // madvise wants a page-aligned start
+    off_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+    off_t aligned = off & ~pagemask;
+    madvise((char *)img.map + aligned, len + (off - aligned), advice);
+    count_io(0, 1);
+}
+
+/*
+ * Returns a read-only view of a filesystem block. With the mmap backend this
+ * points straight into the mapping and buf is not touched; otherwise the block
+ * is read (through the block cache, if enabled) into buf, which must be at
+ * least one block, unless batch_read already fetched it.
+ * Returns NULL if the block is past the end of the image or can't be read.
+ */
+const void *bview(uint bnum, void *buf) {
+    off_t off = (off_t)bnum * BSIZE;
+
+    if (img.overlay.n) {
+        const char *logged = btab_lookup(&img.overlay, bnum);
+        if (logged) return logged;
+    }
 
-int fsfd;  // Global file descriptor
+    if (img.stream) return btab_lookup(&img.kept, bnum);
+    if (img.map) {
+        if (off + BSIZE > img.size) return NULL;
+        count_io(BSIZE, 0);
+        return img.map + off;
+    }
+    const char *kept = btab_lookup(&img.fetched, bnum);
+    if (kept) return kept;
+    if (!buf) return NULL;
+    if (cache.nslots) {
+        pthread_mutex_lock(&cache_lock);
+        int r = cache_read(bnum, buf);
+        pthread_mutex_unlock(&cache_lock);
+        return r < 0 ? NULL : buf;
+    }
+    ssize_t got = pread(img.fd, buf, BSIZE, off);
+    count_io(got > 0 ? got : 0, 1);
+    if (got != BSIZE) {
+        return NULL;
+    }
+    return buf;
+}
 
 /*
  * Read a filesystem block.
@@ -28,711 +502,4678 @@ int fsfd;  // Global file descriptor
  * @return the block number that was read, or -1 on error
  */
 int rblock(uint bnum, void *buf) {
-    if (lseek(fsfd, bnum * BSIZE, 0) != bnum * BSIZE) {
+    const void *p = bview(bnum, buf);
+    if (!p) {
         return -1;
     }
-    if (read(fsfd, buf, BSIZE) != BSIZE) {
+    if (p != buf) memcpy(buf, p, BSIZE);
+    return bnum;
+}
+
+/*
+ * In-memory bitset, one bit per block, packed into 64-bit words so whole
+ * words can be compared at once. Bit b lives in words[b / 64] at b % 64,
+ * which on a little-endian host is exactly the on-disk bitmap byte layout.
+ */
+struct bitmap {
+    uint64 *words;
+    uint nbits;
+    uint nwords;
+};
+
+/*
+ * Allocates a cleared bitset with room for nbits bits, rounded up to whole
+ * bitmap blocks so the on-disk bitmap can be read straight into it.
+ * Returns 0 on success or -1 if memory ran out.
+ */
+int bitmap_alloc(struct bitmap *bm, uint nbits) {
+    size_t bytes = (size_t)((nbits + BPB - 1) / BPB) * BSIZE;
+    if (bytes == 0) bytes = BSIZE;
+
+    void *p;
+    if (posix_memalign(&p, 64, bytes) != 0) {
+        perror("malloc");
         return -1;
     }
-    return bnum;
+    memset(p, 0, bytes);
+    bm->words = p;
+    bm->nbits = nbits;
+    bm->nwords = (nbits + 63) / 64;
+    return 0;
+}
+
+void bitmap_free(struct bitmap *bm) {
+    free(bm->words);
+    bm->words = NULL;
+}
+
+static inline int bitmap_test(const struct bitmap *bm, uint b) {
+    return (bm->words[b / 64] >> (b % 64)) & 1;
+}
+
+static inline void bitmap_set(struct bitmap *bm, uint b) {
+    bm->words[b / 64] |= (uint64)1 << (b % 64);
+}
+
+static inline void bitmap_set_atomic(struct bitmap *bm, uint b) {
+    __atomic_fetch_or(&bm->words[b / 64], (uint64)1 << (b % 64), __ATOMIC_RELAXED);
+}
+
+// Sets bit b and returns what it was
+static inline int bitmap_test_and_set_atomic(struct bitmap *bm, uint b) {
+    uint64 bit = (uint64)1 << (b % 64);
+    return (__atomic_fetch_or(&bm->words[b / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/*
+ * Loads the free bitmap blocks [bmapstart, bmapstart + nbitmap) into memory
+ * with one read per bitmap block. Bits past the end of the image are cleared.
+ * Returns 0 on success or -1 on error.
+ */
+int load_block_bitmap(struct superblock *sb, struct bitmap *bm) {
+    if (bitmap_alloc(bm, sb->size) < 0) return -1;
+
+    uint nbitmap = (sb->size + BPB - 1) / BPB;
+    for (uint i = 0; i < nbitmap; i++) {
+        if (rblock(sb->bmapstart + i, (char *)bm->words + (size_t)i * BSIZE) < 0) {
+            bitmap_free(bm);
+            return -1;
+        }
+    }
+
+    if (sb->size % 64) {
+        bm->words[bm->nwords - 1] &= ((uint64)1 << (sb->size % 64)) - 1;
+    }
+    return 0;
 }
 
 /*
 * Check if a block is marked allocated in the bitmap
 * Returns 1 if allocated, 0 if free, -1 on error
 */
-int is_block_allocated(struct superblock *sb, uint blockno){
-    if(blockno >= sb->size){
+int is_block_allocated(const struct bitmap *bm, uint blockno){
+    if(blockno >= bm->nbits){
         return -1;
     }
     // Block 0 is never allocated in the bitmap
     if(blockno == 0) return 0;
 
-    //Calculate which bitmap block contains this block's bit
-    uint bitmap_block = (blockno / (BSIZE * 8)) + sb -> bmapstart;
-    uint bit_offset = blockno % (BSIZE * 8);
+    return bitmap_test(bm, blockno);
+}
 
-    char bitmap[BSIZE];
-    if (rblock(bitmap_block, bitmap) < 0){
-        return -1;
+/*
+ * Finds the first block at or after start that is set in alloc but not in ref,
+ * comparing 64 blocks per step and using ctz to land on the offending bit.
+ * Returns the block number, or -1 if there is none.
+ */
+long bitmap_next_unreferenced(const struct bitmap *alloc, const struct bitmap *ref, uint start) {
+    if (start >= alloc->nbits) return -1;
+
+    uint w = start / 64;
+    uint64 diff = alloc->words[w] & ~ref->words[w] & (~(uint64)0 << (start % 64));
+    for (;;) {
+        if (diff) return (long)w * 64 + __builtin_ctzll(diff);
+        if (++w >= alloc->nwords) return -1;
+        diff = alloc->words[w] & ~ref->words[w];
+    }
+}
+
+/*
+ * Address validation kernels: check a run of block addresses (the direct
+ * addresses of an inode, or the entries of an indirect block) a vector at a
+ * time. For entry i, bit i % 64 of word i / 64 is set in
+ *   nonzero if the address is set,
+ *   bad     if it is set but not a data block (is_valid_block fails),
+ *   free    if it is a data block that bits, the loaded bitmap, marks free.
+ * free is left empty when bits is NULL. Only the flagged entries need the
+ * slow path that reports them. The kernel is picked once, at startup, for
+ * the CPU: AVX2 (with a gather for the bitmap bits), SSE4.1, or scalar.
+ */
+#define ADDR_WORDS (NINDIRECT / 64)
+
+struct addr_masks {
+    uint64 nonzero[ADDR_WORDS];
+    uint64 bad[ADDR_WORDS];
+    uint64 free[ADDR_WORDS];
+};
+
+static inline void addr_lane(struct addr_masks *out, uint i, uint b, uint lo, uint hi, const uint *bits) {
+    if (b == 0) return;
+    uint64 bit = (uint64)1 << (i % 64);
+    out->nonzero[i / 64] |= bit;
+    if (b < lo || b >= hi || b == 1) {
+        out->bad[i / 64] |= bit;
+    } else if (bits && !((bits[b / 32] >> (b % 32)) & 1)) {
+        out->free[i / 64] |= bit;
     }
+}
+
+void addr_scan_scalar(const uint *a, uint n, uint lo, uint hi, const uint *bits, struct addr_masks *out) {
+    memset(out, 0, sizeof(*out));
+    for (uint i = 0; i < n; i++) {
+        addr_lane(out, i, a[i], lo, hi, bits);
+    }
+}
 
-    return (bitmap[bit_offset/8] >> (bit_offset%8)) & 1;
+#ifdef HAVE_X86_SIMD
+// Unsigned compares are max-and-compare: a >= lo exactly when max(a, lo) == a
+__attribute__((target("sse4.1")))
+void addr_scan_sse4(const uint *a, uint n, uint lo, uint hi, const uint *bits, struct addr_masks *out) {
+    memset(out, 0, sizeof(*out));
+    __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+    __m128i vlo = _mm_set1_epi32(lo), vhi = _mm_set1_epi32(hi);
+
+    uint i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i ge_lo = _mm_cmpeq_epi32(_mm_max_epu32(v, vlo), v);
+        __m128i ge_hi = _mm_cmpeq_epi32(_mm_max_epu32(v, vhi), v);
+        __m128i ok = _mm_andnot_si128(_mm_or_si128(ge_hi, _mm_cmpeq_epi32(v, one)), ge_lo);
+        uint nz = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) & 0xf;
+        uint valid = _mm_movemask_ps(_mm_castsi128_ps(ok)) & nz;
+        uint fr = 0;
+        for (uint m = bits ? valid : 0; m; m &= m - 1) {
+            uint b = a[i + __builtin_ctz(m)];
+            if (!((bits[b / 32] >> (b % 32)) & 1)) fr |= m & -m;
+        }
+        out->nonzero[i / 64] |= (uint64)nz << (i % 64);
+        out->bad[i / 64] |= (uint64)(nz & ~valid) << (i % 64);
+        out->free[i / 64] |= (uint64)fr << (i % 64);
+    }
+    for (; i < n; i++) {
+        addr_lane(out, i, a[i], lo, hi, bits);
+    }
 }
 
+__attribute__((target("avx2")))
+void addr_scan_avx2(const uint *a, uint n, uint lo, uint hi, const uint *bits, struct addr_masks *out) {
+    memset(out, 0, sizeof(*out));
+    __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1);
+    __m256i vlo = _mm256_set1_epi32(lo), vhi = _mm256_set1_epi32(hi);
+    __m256i low5 = _mm256_set1_epi32(31);
+
+    uint i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i ge_lo = _mm256_cmpeq_epi32(_mm256_max_epu32(v, vlo), v);
+        __m256i ge_hi = _mm256_cmpeq_epi32(_mm256_max_epu32(v, vhi), v);
+        __m256i nonzero = _mm256_xor_si256(_mm256_cmpeq_epi32(v, zero), _mm256_set1_epi32(-1));
+        __m256i ok = _mm256_and_si256(_mm256_andnot_si256(_mm256_or_si256(ge_hi, _mm256_cmpeq_epi32(v, one)), ge_lo),
+                                      nonzero);
+        uint nz = _mm256_movemask_ps(_mm256_castsi256_ps(nonzero));
+        uint valid = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+        uint fr = 0;
+        if (bits && valid) {
+            // Only the valid lanes are gathered, so no lane reads past the bitmap
+            __m256i word = _mm256_mask_i32gather_epi32(zero, (const int *)bits, _mm256_srli_epi32(v, 5), ok, 4);
+            __m256i bit = _mm256_and_si256(_mm256_srlv_epi32(word, _mm256_and_si256(v, low5)), one);
+            fr = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(bit, zero))) & valid;
+        }
+        out->nonzero[i / 64] |= (uint64)nz << (i % 64);
+        out->bad[i / 64] |= (uint64)(nz & ~valid) << (i % 64);
+        out->free[i / 64] |= (uint64)fr << (i % 64);
+    }
+    for (; i < n; i++) {
+        addr_lane(out, i, a[i], lo, hi, bits);
+    }
+}
+#endif
 
+void (*addr_scan)(const uint *a, uint n, uint lo, uint hi, const uint *bits, struct addr_masks *out) = addr_scan_scalar;
+const char *addr_kernel = "scalar";
 
 /*
- * Check if a block address is valid
+ * Picks the widest address kernel the CPU runs.
  */
-int is_valid_block(struct superblock *sb, uint blockno) {
-    // Block 0 is invalid (boot sector)
-    // Must be within filesystem size
-    // Must be after bitmap start
-    // Cannot be superblock (block 1)
-    return blockno != 0 && 
-           blockno < sb->size && 
-           blockno >= sb->bmapstart &&
-           blockno != 1;
+void addr_scan_init(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        addr_scan = addr_scan_avx2;
+        addr_kernel = "avx2";
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        addr_scan = addr_scan_sse4;
+        addr_kernel = "sse4.1";
+    }
+#endif
 }
 
+
+
 /*
- * Read an inode from disk
+ * Saturating 2-bit reference counters, 32 per 64-bit word. A counter only
+ * needs to tell 0, 1 and "more than one" apart, so it stops at 2.
  */
-int read_inode(struct superblock *sb, uint inum, struct dinode *dip) {
-    char buf[BSIZE];
-    uint inode_block_num = (inum / IPB) + sb->inodestart;
-    
-    if (rblock(inode_block_num, buf) < 0) {
-        printf("ERROR: failed to read inode block\n");
+#define REF_MANY 2
+#define REF_LOW_BITS 0x5555555555555555ULL   // low bit of every counter
+
+struct refmap {
+    uint64 *words;
+    uint n;
+    uint nwords;
+};
+
+/*
+ * Allocates n cleared counters. Returns 0 on success or -1 if memory ran out.
+ */
+int refmap_alloc(struct refmap *rm, uint n) {
+    rm->nwords = (n + 31) / 32;
+    rm->words = calloc(rm->nwords ? rm->nwords : 1, sizeof(uint64));
+    if (!rm->words) {
+        perror("malloc");
         return -1;
     }
-    
-    *dip = *((struct dinode *)buf + (inum % IPB));
+    rm->n = n;
     return 0;
 }
 
+void refmap_free(struct refmap *rm) {
+    free(rm->words);
+    rm->words = NULL;
+}
+
+static inline uint refmap_get(const struct refmap *rm, uint b) {
+    return (rm->words[b / 32] >> (2 * (b % 32))) & 3;
+}
+
+static inline void refmap_inc(struct refmap *rm, uint b) {
+    uint shift = 2 * (b % 32);
+    if (((rm->words[b / 32] >> shift) & 3) < REF_MANY) {
+        rm->words[b / 32] += (uint64)1 << shift;
+    }
+}
+
+static inline void refmap_inc_atomic(struct refmap *rm, uint b) {
+    uint64 *w = &rm->words[b / 32];
+    uint shift = 2 * (b % 32);
+    uint64 old = __atomic_load_n(w, __ATOMIC_RELAXED);
+    while (((old >> shift) & 3) < REF_MANY &&
+           !__atomic_compare_exchange_n(w, &old, old + ((uint64)1 << shift), 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
 /*
- * Check all blocks referenced by an inode, also verifies blocks are marked allocated in bitmap
+ * Finds the first counter at or after start that has reached REF_MANY,
+ * testing 32 counters per step (REF_MANY is the only value with the high bit set).
+ * Returns the block number, or -1 if there is none.
  */
-int check_inode_blocks(struct superblock *sb, struct dinode *dip) {
-    // Check direct blocks
-    for (int i = 0; i < NDIRECT; i++) {
-        if (dip->addrs[i] != 0 ) {
-            if(!is_valid_block(sb, dip->addrs[i])){
-                printf("ERROR: bad address in inode\n");
-                return -1;
-            } 
-            //New bitmap check
-            int allocated = is_block_allocated(sb, dip->addrs[i]);
-            if(allocated < 0){
-                printf("ERROR: failed to read bitmap\n");
-                return -1;
-            }
-            if(!allocated){
-                printf("ERROR: address used by inode but marked free in bitmap\n");
-                return -1;
-            }
-        }
+long refmap_next_shared(const struct refmap *rm, uint start) {
+    if (start >= rm->n) return -1;
+
+    uint w = start / 32;
+    uint64 high = (rm->words[w] >> 1) & REF_LOW_BITS & (~(uint64)0 << (2 * (start % 32)));
+    for (;;) {
+        if (high) return (long)w * 32 + __builtin_ctzll(high) / 2;
+        if (++w >= rm->nwords) return -1;
+        high = (rm->words[w] >> 1) & REF_LOW_BITS;
     }
+}
 
-    // Check indirect block
-    if (dip->addrs[NDIRECT] != 0) {
-        if (!is_valid_block(sb, dip->addrs[NDIRECT])) {
-            printf("ERROR: bad address in inode\n");
-            return -1;
-        }
+/*
+ * The xv6 on-disk log. Block logstart holds a header: n, and for each of
+ * the n blocks after it the block it is to be installed over. n > 0 means
+ * a transaction was committed but never installed, which the kernel would
+ * do at the next boot. --replay-log checks the image as if it had been:
+ * the logged blocks go into img.overlay, which bview consults first, and
+ * the file is left alone. --install-log writes them in place as the
+ * kernel would, then clears the header.
+ */
+struct logheader {
+    int n;
+    int block[BSIZE / sizeof(int) - 1];
+};
 
-        //Check indirect blocks allocation
-        int allocated = is_block_allocated(sb, dip->addrs[NDIRECT]);
-        if (allocated < 0){
-            printf("ERROR: failed to read bitmap\n");
-            return -1;
-        }
-        if(!allocated){
-            printf("ERROR: address used by inode but marked free in bitmap\n");
-            return -1;
-        }
-        
-        char indirect_block[BSIZE];
-        if (rblock(dip->addrs[NDIRECT], indirect_block) < 0) {
-            printf("ERROR: failed to read indirect block\n");
-            return -1;
+int replay_log = 0;  // --replay-log
+
+/*
+ * Reads and validates the log header: n must fit in the log, and every
+ * destination must be a block of the image outside the boot block,
+ * superblock and log. Returns 0 if the header is sound, -1 if not.
+ */
+int log_read(struct superblock *sb, struct logheader *lh) {
+    char buf[BSIZE];
+    memset(lh, 0, sizeof(*lh));
+    if (sb->nlog == 0) return 0;
+    if (sb->logstart < 2 || sb->logstart + sb->nlog > sb->size) return -1;
+
+    const void *p = bview(sb->logstart, buf);
+    if (!p) return -1;
+    memcpy(lh, p, sizeof(*lh));
+    if (lh->n < 0 || (uint)lh->n >= sb->nlog || (size_t)lh->n > sizeof(lh->block) / sizeof(int)) return -1;
+
+    for (int i = 0; i < lh->n; i++) {
+        uint b = lh->block[i];
+        if (b < 2 || b >= sb->size || (b >= sb->logstart && b < sb->logstart + sb->nlog)) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Lays the logged blocks over their destinations, in log order, so a block
+ * logged twice ends up with its last copy. Returns 0 on success or -1 on error.
+ */
+int log_overlay(struct superblock *sb, struct logheader *lh) {
+    for (int i = 0; i < lh->n; i++) {
+        char *p = btab_insert(&img.overlay, lh->block[i]);
+        if (!p || rblock(sb->logstart + 1 + i, p) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Installs the logged blocks in place and clears the header, syncing after
+ * each step as the kernel's recovery does, so a crash part way through
+ * leaves a log that can still be installed.
+ * Returns the number of blocks installed or -1 on error.
+ */
+int log_install(struct superblock *sb, struct logheader *lh) {
+    char buf[BSIZE];
+    for (int i = 0; i < lh->n; i++) {
+        if (rblock(sb->logstart + 1 + i, buf) < 0) return -1;
+        count_io(0, 1);
+        if (pwrite(img.fd, buf, BSIZE, (off_t)lh->block[i] * BSIZE) != BSIZE) return -1;
+    }
+    count_io(0, 1);
+    if (fsync(img.fd) < 0) return -1;
+
+    int n = lh->n;
+    if (rblock(sb->logstart, buf) < 0) return -1;
+    ((struct logheader *)buf)->n = 0;
+    count_io(0, 2);
+    if (pwrite(img.fd, buf, BSIZE, (off_t)sb->logstart * BSIZE) != BSIZE || fsync(img.fd) < 0) return -1;
+    lh->n = 0;
+    return n;
+}
+
+/*
+ * Streaming input (chkfs -): the image is read once, strictly in block
+ * order, and only the blocks the check will look at are kept. The superblock
+ * says where the inode table and bitmap are; each inode block, as it goes
+ * past, says which blocks further on are indirect or directory blocks, and
+ * a directory's indirect block names the rest of its blocks. A block named
+ * only after it has gone past is taken from a window of the most recent
+ * blocks; one older than that is reported as unreadable.
+ */
+#define STREAM_WINDOW_BLOCKS 4096
+#define STREAM_READ_BLOCKS 64
+
+struct stream {
+    struct superblock sb;
+    int have_sb;
+    uint pos;                   // blocks read so far
+    struct bitmap want;         // blocks still to come that must be kept
+    struct bitmap dir_ind;      // indirect blocks of directories
+    char *window;               // block b is at (b % STREAM_WINDOW_BLOCKS) while recent
+};
+
+/*
+ * Keeps block b if it has been seen: it is either kept already or still in
+ * the window. Otherwise marks it wanted if it is still to come.
+ * Returns 0 on success or -1 if memory ran out.
+ */
+int stream_need(struct stream *st, uint b) {
+    if (b >= st->sb.size) return 0;
+    if (b >= st->pos) {
+        bitmap_set(&st->want, b);
+        return 0;
+    }
+    if (btab_lookup(&img.kept, b) || st->pos - b > STREAM_WINDOW_BLOCKS) return 0;
+
+    char *p = btab_insert(&img.kept, b);
+    if (!p) return -1;
+    memcpy(p, st->window + (size_t)(b % STREAM_WINDOW_BLOCKS) * BSIZE, BSIZE);
+    return 0;
+}
+
+/*
+ * Takes the next block of the stream. Returns 0 on success or -1 if memory ran out.
+ */
+int stream_block(struct stream *st, const char *data) {
+    struct superblock *sb = &st->sb;
+    uint b = st->pos++;
+
+    int keep = b == SUPERBLOCK || (st->have_sb && b < sb->size && bitmap_test(&st->want, b));
+    if (keep) {
+        char *p = btab_insert(&img.kept, b);
+        if (!p) return -1;
+        memcpy(p, data, BSIZE);
+    } else {
+        memcpy(st->window + (size_t)(b % STREAM_WINDOW_BLOCKS) * BSIZE, data, BSIZE);
+    }
+
+    if (b == SUPERBLOCK) {
+        memcpy(sb, data, sizeof(*sb));
+        if (sb->magic != FSMAGIC || sb->size == 0) return 0;  // main reports it
+        if (bitmap_alloc(&st->want, sb->size) < 0 || bitmap_alloc(&st->dir_ind, sb->size) < 0) return -1;
+        st->have_sb = 1;
+
+        // The log, if it is to be replayed; the inode table (with inode
+        // ninodes, which the checks also read) and the bitmap
+        for (uint i = 0; replay_log && i < sb->nlog; i++) {
+            if (stream_need(st, sb->logstart + i) < 0) return -1;
+        }
+        for (uint i = 0; i <= sb->ninodes / IPB; i++) {
+            if (stream_need(st, sb->inodestart + i) < 0) return -1;
+        }
+        for (uint i = 0; i < (sb->size + BPB - 1) / BPB; i++) {
+            if (stream_need(st, sb->bmapstart + i) < 0) return -1;
+        }
+        return 0;
+    }
+    if (!st->have_sb || b >= sb->size) return 0;
+
+    // Past the log, which always comes before what it is installed over
+    struct logheader lh;
+    if (replay_log && sb->nlog && b == sb->logstart + sb->nlog - 1 &&
+        log_read(sb, &lh) == 0 && log_overlay(sb, &lh) < 0) {
+        return -1;
+    }
+    if (img.overlay.n) {
+        const char *logged = btab_lookup(&img.overlay, b);
+        if (logged) data = logged;
+    }
+
+    // An inode block: the indirect blocks, and the blocks of directories
+    if (b >= sb->inodestart && b <= sb->inodestart + sb->ninodes / IPB) {
+        const struct dinode *dip = (const struct dinode *)data;
+        for (uint i = 0; i < IPB; i++) {
+            if (dip[i].type == 0) continue;
+
+            uint ind = dip[i].addrs[NDIRECT];
+            if (ind && stream_need(st, ind) < 0) return -1;
+            if (dip[i].type != T_DIR) continue;
+
+            if (ind && ind < sb->size) bitmap_set(&st->dir_ind, ind);
+            for (int k = 0; k < NDIRECT; k++) {
+                if (dip[i].addrs[k] && stream_need(st, dip[i].addrs[k]) < 0) return -1;
+            }
+        }
+    }
+
+    // A directory's indirect block: the rest of its blocks
+    if (bitmap_test(&st->dir_ind, b)) {
+        const uint *addrs = (const uint *)data;
+        for (uint i = 0; i < NINDIRECT; i++) {
+            if (addrs[i] && stream_need(st, addrs[i]) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the whole image from fd, keeping what the check needs.
+ * Returns 0 on success or -1 on error.
+ */
+int stream_load(int fd) {
+    struct stream st;
+    memset(&st, 0, sizeof(st));
+    char *buf = malloc((size_t)STREAM_READ_BLOCKS * BSIZE);
+    st.window = malloc((size_t)STREAM_WINDOW_BLOCKS * BSIZE);
+    img.fd = fd;
+    img.stream = 1;
+
+    int status = buf && st.window ? 0 : -1;
+    if (status < 0) perror("malloc");
+
+    // Fill the buffer as far as the pipe allows, then hand out whole blocks
+    size_t have = 0;
+    for (int eof = 0; status == 0 && !eof; ) {
+        ssize_t got = read(fd, buf + have, (size_t)STREAM_READ_BLOCKS * BSIZE - have);
+        count_io(got > 0 ? got : 0, 1);
+        if (got < 0) {
+            perror("read");
+            status = -1;
+            break;
+        }
+        eof = got == 0;
+        have += got;
+
+        size_t whole = have - have % BSIZE;
+        if (!eof && whole < (size_t)STREAM_READ_BLOCKS * BSIZE) continue;
+        for (size_t off = 0; off < whole && status == 0; off += BSIZE) {
+            status = stream_block(&st, buf + off);
+        }
+        memmove(buf, buf + whole, have - whole);
+        have -= whole;
+    }
+
+    img.size = (off_t)st.pos * BSIZE;
+    bitmap_free(&st.want);
+    bitmap_free(&st.dir_ind);
+    free(st.window);
+    free(buf);
+    return status;
+}
+
+/*
+ * Check if a block address is valid
+ */
+int is_valid_block(struct superblock *sb, uint blockno) {
+    // Block 0 is invalid (boot sector)
+    // Must be within filesystem size
+    // Must be after bitmap start
+    // Cannot be superblock (block 1)
+    return blockno != 0 && 
+           blockno < sb->size && 
+           blockno >= sb->bmapstart &&
+           blockno != 1;
+}
+
+/*
+ * Makes room for at least need elements in a growable array.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int grow_array(void **arr, uint *cap, uint need, size_t elem_size) {
+    if (need <= *cap) return 0;
+
+    uint ncap = *cap ? *cap : 1024;
+    while (ncap < need) ncap *= 2;
+
+    void *p = realloc(*arr, ncap * elem_size);
+    if (!p) {
+        perror("malloc");
+        return -1;
+    }
+    *arr = p;
+    *cap = ncap;
+    return 0;
+}
+
+/*
+ * Batched reads. Once the inode table is in memory the indirect blocks, and
+ * once those are, the directory blocks, are all known up front. Instead of
+ * reading them one at a time as the scan reaches them, they are gathered,
+ * sorted, merged into runs of adjacent blocks and read with many requests in
+ * flight: through io_uring where the kernel allows it, else by a pool of
+ * threads issuing preadv. Each block is handed to a callback as its read
+ * completes (NULL if it failed). With a mapping there is nothing to read
+ * into; the runs are passed to madvise(MADV_WILLNEED) so the kernel fetches
+ * them all at once instead of faulting them in one by one.
+ */
+#define BATCH_DEFAULT_DEPTH 64
+#define BATCH_RUN_BLOCKS 32
+#define BATCH_MAX_THREADS 16
+#define BATCH_MAX_DEPTH 1024
+
+uint batch_depth = BATCH_DEFAULT_DEPTH;  // reads in flight (--io-depth); 0 turns batching off
+
+struct read_batch {
+    uint *blocks;
+    uint n, cap;
+};
+
+typedef void (*block_done_fn)(void *arg, uint blockno, const void *data);
+
+struct batch_run {
+    uint start, nblocks;
+};
+
+struct batch_job {
+    struct batch_run *runs;
+    uint nruns;
+    uint next;              // next run to claim (thread pool)
+    block_done_fn done;
+    void *arg;
+};
+
+/*
+ * Queues a block for batch_read. Returns 0 on success, -1 if memory ran out.
+ */
+int batch_add(struct read_batch *b, uint blockno) {
+    if (grow_array((void **)&b->blocks, &b->cap, b->n + 1, sizeof(uint)) < 0) return -1;
+    b->blocks[b->n++] = blockno;
+    return 0;
+}
+
+void batch_free(struct read_batch *b) {
+    free(b->blocks);
+    memset(b, 0, sizeof(*b));
+}
+
+int cmp_uint(const void *a, const void *b) {
+    uint x = *(const uint *)a, y = *(const uint *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Hands out the blocks of a finished run; those past got bytes failed.
+ */
+void batch_complete(struct batch_job *job, struct batch_run *run, const char *buf, ssize_t got) {
+    for (uint k = 0; k < run->nblocks; k++) {
+        int ok = got >= (ssize_t)(k + 1) * BSIZE;
+        job->done(job->arg, run->start + k, ok ? buf + (size_t)k * BSIZE : NULL);
+    }
+}
+
+void *batch_thread(void *arg) {
+    struct batch_job *job = arg;
+    char *buf = malloc((size_t)BATCH_RUN_BLOCKS * BSIZE);
+    if (!buf) return NULL;
+
+    for (;;) {
+        uint i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->nruns) break;
+
+        struct batch_run *run = &job->runs[i];
+        struct iovec iov = { buf, (size_t)run->nblocks * BSIZE };
+        ssize_t got = preadv(img.fd, &iov, 1, (off_t)run->start * BSIZE);
+        count_io(got > 0 ? got : 0, 1);
+        batch_complete(job, run, buf, got);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * The preadv fallback: nthreads threads claim runs until none are left.
+ * Returns 0 on success or -1 if no thread could be started.
+ */
+int batch_threads(struct batch_job *job, int nthreads) {
+    pthread_t threads[BATCH_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, batch_thread, job) == 0) started++;
+    }
+    if (!started) return -1;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * A minimal io_uring, set up with the raw system calls so there is nothing
+ * to link against.
+ */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+void uring_exit(struct uring *u) {
+    if (u->sqes) munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_len);
+    if (u->sq_ring) munmap(u->sq_ring, u->sq_len);
+    close(u->fd);
+}
+
+/*
+ * Returns 0 on success or -1 if the kernel won't give us a ring.
+ */
+int uring_init(struct uring *u, uint depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (u->fd < 0) return -1;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+        u->cq_len = u->sq_len;
+    }
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        uring_exit(u);
+        return -1;
+    }
+    u->cq_ring = u->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            uring_exit(u);
+            return -1;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        uring_exit(u);
+        return -1;
+    }
+
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Keeps up to depth runs in flight, each with its own buffer, refilling a
+ * slot as soon as its read completes.
+ * Returns 0 on success or -1 if the ring failed; runs already completed
+ * have been handed out, and *resume says where to carry on.
+ */
+int batch_uring(struct batch_job *job, uint depth, uint *resume) {
+    struct uring u;
+    if (uring_init(&u, depth) < 0) return -1;
+
+    char *bufs = malloc((size_t)depth * BATCH_RUN_BLOCKS * BSIZE);
+    struct iovec *iov = calloc(depth, sizeof(struct iovec));
+    uint *slot_run = calloc(depth, sizeof(uint));
+    uint *free_slots = calloc(depth, sizeof(uint));
+    int status = bufs && iov && slot_run && free_slots ? 0 : -1;
+    uint nfree = depth, inflight = 0, next = 0;
+    for (uint i = 0; i < depth && status == 0; i++) free_slots[i] = i;
+
+    while (status == 0 && (next < job->nruns || inflight)) {
+        // Fill the submission queue
+        unsigned tail = *u.sq_tail, queued = 0;
+        while (next < job->nruns && nfree) {
+            uint slot = free_slots[--nfree];
+            struct batch_run *run = &job->runs[next];
+            iov[slot].iov_base = bufs + (size_t)slot * BATCH_RUN_BLOCKS * BSIZE;
+            iov[slot].iov_len = (size_t)run->nblocks * BSIZE;
+            slot_run[slot] = next++;
+
+            unsigned idx = tail & *u.sq_mask;
+            struct io_uring_sqe *sqe = &u.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = img.fd;
+            sqe->addr = (unsigned long)&iov[slot];
+            sqe->len = 1;
+            sqe->off = (off_t)run->start * BSIZE;
+            sqe->user_data = slot;
+            u.sq_array[idx] = idx;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(u.sq_tail, tail, __ATOMIC_RELEASE);
+        inflight += queued;
+
+        // Whatever the kernel hasn't taken yet, including after an EINTR
+        unsigned pending = tail - __atomic_load_n(u.sq_head, __ATOMIC_ACQUIRE);
+        count_io(0, 1);
+        if (syscall(__NR_io_uring_enter, u.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) continue;
+            status = -1;
+            break;
+        }
+
+        // Reap what has completed
+        unsigned head = *u.cq_head;
+        unsigned ctail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+            uint slot = cqe->user_data;
+            count_io(cqe->res > 0 ? cqe->res : 0, 0);
+            batch_complete(job, &job->runs[slot_run[slot]], iov[slot].iov_base, cqe->res);
+            free_slots[nfree++] = slot;
+            inflight--;
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // A ring that failed with reads in flight can't be trusted to have let go
+    // of the buffers, so only a clean finish (or a failure before any read) falls back
+    *resume = inflight ? job->nruns : next;
+    free(bufs);
+    free(iov);
+    free(slot_run);
+    free(free_slots);
+    uring_exit(&u);
+    return status;
+}
+#endif
+
+/*
+ * Reads every block in the batch, calling done for each as its read
+ * completes. With io_uring done is called from this thread; with the
+ * thread pool, from the pool's threads, so it must be thread-safe.
+ * Returns 0 on success or -1 on error.
+ */
+int batch_read(struct read_batch *b, uint depth, block_done_fn done, void *arg) {
+    if (b->n == 0) return 0;
+
+    // Sort, drop repeats and merge neighbours into runs
+    qsort(b->blocks, b->n, sizeof(uint), cmp_uint);
+    struct batch_run *runs = malloc(b->n * sizeof(struct batch_run));
+    if (!runs) {
+        perror("malloc");
+        return -1;
+    }
+    uint nruns = 0;
+    for (uint i = 0; i < b->n; i++) {
+        uint blk = b->blocks[i];
+        struct batch_run *last = nruns ? &runs[nruns - 1] : NULL;
+        if (last && blk < last->start + last->nblocks) continue;  // repeat
+        if (last && blk == last->start + last->nblocks && last->nblocks < BATCH_RUN_BLOCKS) {
+            last->nblocks++;
+        } else {
+            runs[nruns++] = (struct batch_run){ blk, 1 };
+        }
+    }
+
+    int status = 0;
+    if (img.map) {
+        for (uint i = 0; i < nruns; i++) {
+            image_advise(runs[i].start, runs[i].nblocks, MADV_WILLNEED);
+        }
+    } else {
+        struct batch_job job = { runs, nruns, 0, done, arg };
+#ifdef HAVE_IO_URING
+        if (batch_uring(&job, depth, &job.next) == 0) job.next = nruns;
+#endif
+        if (job.next < nruns) {
+            status = batch_threads(&job, depth < BATCH_MAX_THREADS ? depth : BATCH_MAX_THREADS);
+        }
+    }
+    free(runs);
+    return status;
+}
+
+pthread_mutex_t fetched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Completion callback that keeps each block in img.fetched, where bview finds it.
+ */
+void keep_fetched(void *arg, uint blockno, const void *data) {
+    (void)arg;
+    if (!data) return;  // bview will retry and fail on its own
+
+    pthread_mutex_lock(&fetched_lock);
+    char *p = btab_insert(&img.fetched, blockno);
+    if (p) memcpy(p, data, BSIZE);
+    pthread_mutex_unlock(&fetched_lock);
+}
+
+/*
+ * Block references spilled to disk, for images whose per-block maps don't
+ * fit in --mem-limit. Each reference is a (block, inode, slot) tuple; the
+ * tuples are gathered in a bounded buffer, sorted and written to a scratch
+ * file as a run each time it fills, and read back in block order with a
+ * k-way merge. Memory stays within the limit whatever the size of the image.
+ */
+#define SPILL_MIN_TUPLES 1024
+#define MERGE_MIN_TUPLES 64
+
+size_t mem_limit = 0;  // --mem-limit: most bytes the per-block maps may take, 0 for no limit
+
+/*
+ * Bytes taken by the per-block maps of an image: the reference counts,
+ * the referenced bitset and the loaded free bitmap.
+ */
+size_t block_maps_bytes(uint nblocks) {
+    return ((size_t)(nblocks + 31) / 32 + 2 * ((size_t)(nblocks + 63) / 64)) * sizeof(uint64);
+}
+
+struct ref_tuple {
+    uint blockno;
+    uint inum;              // 0 for the metadata regions
+    uint slot;              // address slot: direct, NDIRECT for the indirect block, then its entries
+};
+
+struct spill_run {
+    off_t off;
+    uint n;                 // tuples in the run
+};
+
+struct spill {
+    int fd;                 // unlinked scratch file, -1 if not open
+    off_t end;
+    struct spill_run *runs;
+    uint nruns, cap;
+    pthread_mutex_t lock;   // workers write runs concurrently
+};
+
+int cmp_tuple(const void *a, const void *b) {
+    const struct ref_tuple *x = a, *y = b;
+    if (x->blockno != y->blockno) return x->blockno < y->blockno ? -1 : 1;
+    if (x->inum != y->inum) return x->inum < y->inum ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/*
+ * Creates the scratch file in $TMPDIR (or /tmp); it is unlinked at once so
+ * it goes away with the process. Returns 0 on success or -1 on error.
+ */
+int spill_open(struct spill *s) {
+    const char *dir = getenv("TMPDIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/chkfs-spill-XXXXXX", dir && *dir ? dir : "/tmp");
+
+    memset(s, 0, sizeof(*s));
+    s->fd = mkstemp(path);
+    if (s->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    unlink(path);
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+void spill_close(struct spill *s) {
+    if (s->fd < 0) return;
+    close(s->fd);
+    free(s->runs);
+    pthread_mutex_destroy(&s->lock);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+/*
+ * Sorts n tuples and appends them to the scratch file as a run.
+ * Returns 0 on success or -1 on error.
+ */
+int spill_write(struct spill *s, struct ref_tuple *t, uint n) {
+    if (n == 0) return 0;
+    qsort(t, n, sizeof(*t), cmp_tuple);
+
+    size_t len = (size_t)n * sizeof(*t);
+    pthread_mutex_lock(&s->lock);
+    int status = grow_array((void **)&s->runs, &s->cap, s->nruns + 1, sizeof(struct spill_run));
+    off_t off = s->end;
+    if (status == 0) {
+        s->runs[s->nruns++] = (struct spill_run){ off, n };
+        s->end += len;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (status < 0) return -1;
+
+    for (size_t done = 0; done < len; ) {
+        ssize_t w = pwrite(s->fd, (char *)t + done, len - done, off + done);
+        if (w <= 0) {
+            perror("spill");
+            return -1;
+        }
+        done += w;
+    }
+    __atomic_add_fetch(&stats.spill_runs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.spill_bytes, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Reads the runs back as one sequence in (block, inode, slot) order. Each
+ * run has a buffer; a heap keeps the runs ordered by the tuple at their head.
+ */
+struct merge_src {
+    off_t off;              // next tuple of the run not yet in buf
+    uint left;              // tuples of the run not yet in buf
+    struct ref_tuple *buf;
+    uint n, pos;            // tuples in buf, next one to hand out
+};
+
+struct spill_merge {
+    struct spill *s;
+    struct merge_src *src;
+    uint *heap;
+    uint nheap;
+    uint bufcap;            // tuples per run buffer
+    struct ref_tuple *bufs;
+};
+
+/*
+ * Refills a run's buffer. Returns 0 on success or -1 on a read error.
+ */
+int merge_fill(struct spill_merge *mg, struct merge_src *src) {
+    uint n = src->left < mg->bufcap ? src->left : mg->bufcap;
+    size_t len = (size_t)n * sizeof(struct ref_tuple);
+    for (size_t done = 0; done < len; ) {
+        ssize_t r = pread(mg->s->fd, (char *)src->buf + done, len - done, src->off + done);
+        count_io(r > 0 ? r : 0, 1);
+        if (r <= 0) {
+            perror("spill");
+            return -1;
+        }
+        done += r;
+    }
+    src->off += len;
+    src->left -= n;
+    src->n = n;
+    src->pos = 0;
+    return 0;
+}
+
+static int merge_less(struct spill_merge *mg, uint a, uint b) {
+    struct merge_src *x = &mg->src[a], *y = &mg->src[b];
+    return cmp_tuple(&x->buf[x->pos], &y->buf[y->pos]) < 0;
+}
+
+static void merge_sift(struct spill_merge *mg, uint i) {
+    for (;;) {
+        uint l = 2 * i + 1, r = l + 1, min = i;
+        if (l < mg->nheap && merge_less(mg, mg->heap[l], mg->heap[min])) min = l;
+        if (r < mg->nheap && merge_less(mg, mg->heap[r], mg->heap[min])) min = r;
+        if (min == i) return;
+        uint t = mg->heap[i];
+        mg->heap[i] = mg->heap[min];
+        mg->heap[min] = t;
+        i = min;
+    }
+}
+
+void merge_close(struct spill_merge *mg) {
+    free(mg->src);
+    free(mg->heap);
+    free(mg->bufs);
+    memset(mg, 0, sizeof(*mg));
+}
+
+/*
+ * Starts a merge of every run, splitting budget bytes between the run buffers.
+ * Returns 0 on success or -1 on error.
+ */
+int merge_open(struct spill_merge *mg, struct spill *s, size_t budget) {
+    memset(mg, 0, sizeof(*mg));
+    mg->s = s;
+    uint k = s->nruns ? s->nruns : 1;
+    mg->bufcap = budget / k / sizeof(struct ref_tuple);
+    if (mg->bufcap < MERGE_MIN_TUPLES) mg->bufcap = MERGE_MIN_TUPLES;
+
+    mg->src = calloc(k, sizeof(struct merge_src));
+    mg->heap = calloc(k, sizeof(uint));
+    mg->bufs = malloc((size_t)k * mg->bufcap * sizeof(struct ref_tuple));
+    if (!mg->src || !mg->heap || !mg->bufs) {
+        perror("malloc");
+        merge_close(mg);
+        return -1;
+    }
+    for (uint i = 0; i < s->nruns; i++) {
+        struct merge_src *src = &mg->src[i];
+        src->off = s->runs[i].off;
+        src->left = s->runs[i].n;
+        src->buf = mg->bufs + (size_t)i * mg->bufcap;
+        if (merge_fill(mg, src) < 0) {
+            merge_close(mg);
+            return -1;
+        }
+        if (src->n) mg->heap[mg->nheap++] = i;
+    }
+    for (uint i = mg->nheap / 2; i-- > 0; ) {
+        merge_sift(mg, i);
+    }
+    return 0;
+}
+
+/*
+ * Hands out the next tuple in order.
+ * Returns 1 if there was one, 0 at the end, -1 on a read error.
+ */
+int merge_next(struct spill_merge *mg, struct ref_tuple *t) {
+    if (mg->nheap == 0) return 0;
+
+    struct merge_src *src = &mg->src[mg->heap[0]];
+    *t = src->buf[src->pos++];
+    if (src->pos == src->n) {
+        if (src->left && merge_fill(mg, src) < 0) return -1;
+        if (src->pos == src->n) mg->heap[0] = mg->heap[--mg->nheap];
+    }
+    merge_sift(mg, 0);
+    return 1;
+}
+
+/*
+ * Error classes, numbered as in the README. CHECK_IO covers reads that failed.
+ */
+enum {
+    CHECK_IO = 0,
+    CHECK_BAD_ADDRESS = 1,
+    CHECK_DIR_FORMAT = 2,
+    CHECK_PARENT_MISMATCH = 3,
+    CHECK_MARKED_FREE = 4,
+    CHECK_BITMAP_UNUSED = 5,
+    CHECK_MULTIPLY_USED = 6,
+    CHECK_NOT_IN_DIR = 7,
+    CHECK_REFERS_TO_FREE = 8,
+    CHECK_LINK_COUNT = 9,
+    CHECK_SIZE_MISMATCH = 10,
+    CHECK_DUPLICATE_NAME = 11,
+    CHECK_UNREACHABLE = 12,
+    CHECK_MULTIPLE_PARENTS = 13,
+    CHECK_DIR_CYCLE = 14,
+};
+
+/*
+ * One problem found by a check. The directory path is worked out from the
+ * model only when the finding is printed.
+ */
+struct finding {
+    int check;
+    uint inum;              // 0 if no inode is involved
+    uint blockno;           // 0 if no block is involved
+    const char *msg;
+};
+
+struct findings {
+    struct finding *list;
+    uint n, cap;
+};
+
+/*
+ * Appends a finding. Returns 0 on success or -1 if memory ran out.
+ */
+int add_finding(struct findings *f, int check, uint inum, uint blockno, const char *msg) {
+    if (grow_array((void **)&f->list, &f->cap, f->n + 1, sizeof(struct finding)) < 0) {
+        return -1;
+    }
+    f->list[f->n++] = (struct finding){ check, inum, blockno, msg };
+    return 0;
+}
+
+/*
+ * Reachability from the root: a parallel walk of the directory tree over
+ * the workers. Each worker owns a deque of directories still to read; it
+ * pushes and pops at the bottom and, when it runs dry, steals from the top
+ * of the others'. An inode's bit in reached is claimed with an atomic
+ * fetch-or, so each directory is queued once however many name it. pending
+ * counts directories queued but not yet read; the walk ends when it drops
+ * to 0. The set reached is the same whatever the order.
+ */
+struct dir_deque {
+    pthread_mutex_t lock;
+    uint *items;            // items[top .. bottom) are queued
+    uint top, bottom, cap;
+};
+
+/*
+ * One slice of the inode table, scanned by one thread. Ranges are whole
+ * inode blocks and are kept in inode order, so anything merged or reported
+ * range by range comes out exactly as a serial scan would produce it.
+ */
+struct scan_worker {
+    struct fsck_model *m;
+    pthread_t thread;
+    uint lo, hi;                // inodes [lo, hi)
+
+    struct arena arena;         // copied indirect blocks and the dirents of this range
+    uint ndirents;              // live entries kept for the directories in this range
+    int status;                 // -1 if memory ran out (or a spill failed)
+
+    struct ref_tuple *refs;     // --mem-limit: references not yet spilled
+    uint nrefs, maxrefs;
+    uint bmap_blockno;          // --mem-limit: the bitmap block in bmap_buf, 0 if none
+    char bmap_buf[BSIZE];
+
+    struct findings found;      // check_all_inodes: findings in this range
+    struct dir_deque deque;     // check_reachable: directories this worker has yet to read
+};
+
+/*
+ * The inode table decoded into columns, one array per field indexed by inode
+ * number, so a pass over the whole table reads only the fields it tests, and
+ * reads them contiguously. flags holds the per-inode predicates below,
+ * derived once for every check to share.
+ */
+struct inode_table {
+    short *type;
+    short *nlink;
+    uint *size;
+    uint *addrs;    // the direct addresses of inode i, at addrs[i * NDIRECT]
+    uint *ind;      // the indirect block address of each inode
+    uchar *flags;
+};
+
+enum {
+    INODE_USED = 1,         // type is not 0
+    INODE_DIR = 2,          // a directory
+    INODE_HAS_BLOCKS = 4,   // some direct or indirect address is set
+    INODE_BAD_ADDR = 8,     // some direct or indirect address is set but not a data block
+    INODE_EMPTY_BLOCKS = 16 // size 0 but has blocks
+};
+
+/*
+ * What the last run derived from the blocks outside the inode table
+ * (--cache): the indirect entries and live dirents it kept for each inode,
+ * loaded back from the cache file. dirty marks the 64 KiB regions whose
+ * fingerprint has changed since; an inode whose blocks all lie outside them
+ * takes its entries from here instead of reading and decoding them again.
+ */
+#define FP_REGION_BLOCKS 64     // 64 KiB regions
+
+struct prior_state {
+    uint n;                         // inodes covered, 0 if nothing was loaded
+    int *ind_count;                 // each as in the model
+    int *dir_count;
+    int *dotdot;
+    char *dir_format_ok;
+    const uint **indirect;          // views into data
+    const struct dirent **dir_ents;
+    void *data;
+    struct bitmap dirty;            // bit r set if region r changed or is new
+    uint reused;                    // inodes in use that took their entries from here
+};
+
+/*
+ * In-memory model of the filesystem, filled by one scan of the inode table
+ * and one read of every directory and indirect block. All of the checks
+ * below run against this model instead of going back to the disk.
+ */
+struct fsck_model {
+    struct superblock *sb;
+
+    // Inode summary: inodes 0..ninodes (check_all_inodes looks at ninodes too)
+    struct inode_table itab;
+
+    // Entries of each inode's indirect block: a view into the mapping or into a worker's pool
+    const uint **indirect;
+    int *ind_count;         // -1 if the indirect block could not be read
+
+    // Dirent graph: the live entries of each directory, dir_count[inum] of them
+    // at dir_ents[inum], kept in the arena of the worker that read it
+    const struct dirent **dir_ents;
+    int *dir_count;         // -1 if the directory could not be read
+    int *dotdot;            // parent link: inode named by "..", or -1 if there is none
+
+    // Reverse index of the dirent graph (CSR): the directories naming inode i are
+    // in_src[in_start[i] .. in_start[i+1]), once per entry, in directory order
+    uint *in_start;
+    uint *in_src;
+    char *dir_format_ok;    // 1 if the directory has "." (pointing to itself) and ".."
+    uint *links;            // entries naming inode i other than as ".", to compare with nlink
+    uint *parents;          // entries naming inode i other than as "." or ".."
+    uint *namer;            // the first directory naming inode i other than as "." or "..", else 0
+
+    // Reachability (check_reachable): bit i set if inode i can be reached from the root
+    struct bitmap reached;
+    uint walk_pending;          // directories queued but not yet read
+    int walk_failed;            // set if memory ran out during the walk
+
+    // Reference counts derived from the above
+    struct bitmap inode_refs;   // bit i set if inode i is named in some directory
+    struct refmap block_refs;   // references to each block: 0, 1 or REF_MANY
+    int block_refs_bad;         // set if an inode pointed past the end of the image
+    struct bitmap block_used;   // bit b set if block b is referenced at all
+
+    struct bitmap allocated;    // the on-disk free bitmap
+
+    // With spilling set (--mem-limit) none of the per-block maps above exist:
+    // block references go to sorted runs on disk and the bitmap is read as needed
+    int spilling;
+    struct spill spill;
+
+    uint ndirents;              // live entries over all directories
+
+    struct scan_worker *workers;    // the inode table split into nworkers ranges
+    int nworkers;
+
+    struct prior_state *prior;  // --cache: what the last run derived, or NULL
+    uchar *reuse;               // 1 if inode i takes its entries from prior
+
+    int report_all;             // keep checking after the first finding (--all)
+    struct findings findings;   // everything the checks found, in the order found
+};
+
+/*
+ * Records a finding against the model.
+ * Returns -1 if checking should stop here (the default, or memory ran out), 0 with --all.
+ */
+int report(struct fsck_model *m, int check, uint inum, uint blockno, const char *msg) {
+    if (add_finding(&m->findings, check, inum, blockno, msg) < 0) return -1;
+    return m->report_all ? 0 : -1;
+}
+
+/*
+ * Zero-copy walk over a directory's blocks: direct blocks, then the entries
+ * of its indirect block as read by scan_inode(). Each step hands out one
+ * block of entries, a view into the mapping or into the iterator's buffer,
+ * valid until the next step.
+ */
+struct dirent_iter {
+    struct fsck_model *m;
+    uint inum;
+    int next;               // next address slot: direct, then NDIRECT + indirect index
+    char buf[BSIZE];        // holds the block when it can't be viewed in place
+};
+
+#define DPB (BSIZE / sizeof(struct dirent))  // dirents per block
+
+void dirent_iter_init(struct dirent_iter *it, struct fsck_model *m, uint inum) {
+    it->m = m;
+    it->inum = inum;
+    it->next = 0;
+}
+
+/*
+ * Points *ents at the DPB entries of the directory's next block.
+ * Returns 1 if there was one, 0 at the end, -1 if a block could not be read.
+ */
+int dirent_iter_next(struct dirent_iter *it, const struct dirent **ents) {
+    struct fsck_model *m = it->m;
+    const uint *addrs = &m->itab.addrs[it->inum * NDIRECT];
+    uint blockno = 0;
+
+    while (blockno == 0 && it->next < NDIRECT) {
+        blockno = addrs[it->next++];
+    }
+    if (blockno == 0 && m->itab.ind[it->inum] != 0) {
+        if (m->ind_count[it->inum] < 0) return -1;
+        while (blockno == 0 && it->next < NDIRECT + m->ind_count[it->inum]) {
+            blockno = m->indirect[it->inum][it->next++ - NDIRECT];
+        }
+    }
+    if (blockno == 0) return 0;
+
+    *ents = bview(blockno, it->buf);
+    return *ents ? 1 : -1;
+}
+
+/*
+ * Masks over the DPB entries of a directory block, bit i for entry i.
+ * dot and dotdot say what the name is, whether or not the entry is live.
+ */
+struct dirent_masks {
+    uint64 live;    // inum is not 0
+    uint64 dot;     // the name is "."
+    uint64 dotdot;  // the name is ".."
+};
+
+/*
+ * Classifies a directory block. An entry is 16 bytes, so with SSE2 each one
+ * is loaded into a vector and compared twice, against zero and against
+ * "\0\0..\0": the first gives a zero inode number and the byte ending the
+ * name, the second the dots.
+ */
+void dirent_scan(const struct dirent *ents, struct dirent_masks *out) {
+    uint64 live = 0, dot = 0, dotdot = 0;
+
+#if defined(HAVE_X86_SIMD) && defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i dots = _mm_setr_epi8(0, 0, '.', '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    for (uint i = 0; i < DPB; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&ents[i]);
+        uint z = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        uint d = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dots));
+        live |= (uint64)((z & 0x3) != 0x3) << i;
+        dot |= (uint64)((d & 0x4) && (z & 0x8)) << i;
+        dotdot |= (uint64)((d & 0x1c) == 0x1c) << i;
+    }
+#else
+    for (uint i = 0; i < DPB; i++) {
+        const char *name = ents[i].name;
+        live |= (uint64)(ents[i].inum != 0) << i;
+        dot |= (uint64)(name[0] == '.' && name[1] == 0) << i;
+        dotdot |= (uint64)(name[0] == '.' && name[1] == '.' && name[2] == 0) << i;
+    }
+#endif
+    out->live = live;
+    out->dot = dot;
+    out->dotdot = dotdot;
+}
+
+/*
+ * Keeps the live entries of the given directory, contiguously, in the
+ * worker's arena and points dir_ents at them. Blocks are viewed in place
+ * and only the live entries are copied. The same pass finds "." and "..":
+ * dotdot gets the inode the first ".." names, and dir_format_ok is set if
+ * there is a ".." and a "." and every "." names the directory itself.
+ * Returns the number of entries kept or -1 on error.
+ */
+int read_all_dirents(struct scan_worker *w, uint inum) {
+    struct fsck_model *m = w->m;
+    struct dirent_iter it;
+    const struct dirent *ents;
+    struct dirent *kept = NULL;
+    int total = 0, r;
+    int dotdot = -1, found_dot = 0, dot_ok = 1;
+
+    dirent_iter_init(&it, m, inum);
+    while ((r = dirent_iter_next(&it, &ents)) > 0) {
+        // Room for the whole block; unused space is given back by the next grow
+        kept = arena_grow(&w->arena, kept, total * sizeof(struct dirent),
+                          (total + DPB) * sizeof(struct dirent));
+        if (!kept) {
+            perror("malloc");
+            w->status = -1;
+            return -1;
+        }
+        struct dirent_masks dm;
+        dirent_scan(ents, &dm);
+        for (uint64 set = dm.live; set; set &= set - 1) {
+            kept[total++] = ents[__builtin_ctzll(set)];
+        }
+        for (uint64 set = dm.live & dm.dot; set; set &= set - 1) {
+            found_dot = 1;
+            dot_ok &= ents[__builtin_ctzll(set)].inum == inum;
+        }
+        if (dotdot < 0 && (dm.live & dm.dotdot)) {
+            dotdot = ents[__builtin_ctzll(dm.live & dm.dotdot)].inum;
+        }
+    }
+    if (r < 0) return -1;
+
+    // Trim the reservation down to the entries kept
+    if (kept) w->arena.cur = (char *)kept + ((total * sizeof(struct dirent) + 7) & ~(size_t)7);
+    m->dir_ents[inum] = kept;
+    m->dotdot[inum] = dotdot;
+    m->dir_format_ok[inum] = found_dot && dot_ok && dotdot >= 0;
+    w->ndirents += total;
+    return total;
+}
+
+/*
+ * Takes a directory's live entries, "..", and format from the last run (--cache).
+ * Returns the number of entries.
+ */
+int prior_dirents(struct scan_worker *w, uint inum) {
+    struct fsck_model *m = w->m;
+    m->dir_ents[inum] = m->prior->dir_ents[inum];
+    m->dotdot[inum] = m->prior->dotdot[inum];
+    m->dir_format_ok[inum] = m->prior->dir_format_ok[inum];
+    w->ndirents += m->prior->dir_count[inum];
+    return m->prior->dir_count[inum];
+}
+
+/*
+ * Reads the indirect block of an inode into the model. Only done when the
+ * pointer lies inside the image; check_all_inodes rejects the other bad pointers
+ * before it ever looks at the entries.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int scan_inode(struct scan_worker *w, uint inum) {
+    struct fsck_model *m = w->m;
+    uint ind = m->itab.ind[inum];
+
+    m->indirect[inum] = NULL;
+    m->ind_count[inum] = 0;
+    if (!(m->itab.flags[inum] & INODE_USED) || ind == 0 || ind >= m->sb->size) return 0;
+    if (m->reuse && m->reuse[inum]) {
+        m->indirect[inum] = m->prior->indirect[inum];
+        m->ind_count[inum] = m->prior->ind_count[inum];
+        return 0;
+    }
+
+    // Mapped, streamed and prefetched blocks are used in place
+    m->indirect[inum] = bview(ind, NULL);
+    if (!m->indirect[inum] && !img.map && !img.stream) {
+        void *buf = arena_alloc(&w->arena, BSIZE);
+        if (!buf) {
+            perror("malloc");
+            return -1;
+        }
+        m->indirect[inum] = bview(ind, buf);
+    }
+    m->ind_count[inum] = m->indirect[inum] ? NINDIRECT : -1;
+    return 0;
+}
+
+/*
+ * Writes a worker's pending references out as a run.
+ * Returns 0 on success or -1 on error, which stops the worker.
+ */
+int spill_flush(struct scan_worker *w) {
+    if (spill_write(&w->m->spill, w->refs, w->nrefs) < 0) {
+        w->status = -1;
+        return -1;
+    }
+    w->nrefs = 0;
+    return 0;
+}
+
+/*
+ * Counts one block reference, remembering if the address is past the end of the image.
+ * With more than one scan thread the shared counters are updated atomically; when
+ * spilling the reference is queued in the worker's buffer, where inum and slot say who holds it.
+ */
+void add_block_ref(struct scan_worker *w, uint inum, uint slot, uint blockno) {
+    struct fsck_model *m = w->m;
+    if (blockno >= m->sb->size) {
+        __atomic_store_n(&m->block_refs_bad, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (m->spilling) {
+        if (w->status < 0 || (w->nrefs == w->maxrefs && spill_flush(w) < 0)) return;
+        w->refs[w->nrefs++] = (struct ref_tuple){ blockno, inum, slot };
+        return;
+    }
+    if (m->nworkers > 1) {
+        refmap_inc_atomic(&m->block_refs, blockno);
+        bitmap_set_atomic(&m->block_used, blockno);
+    } else {
+        refmap_inc(&m->block_refs, blockno);
+        bitmap_set(&m->block_used, blockno);
+    }
+}
+
+/*
+ * Counts the references held by the metadata regions themselves
+ */
+void count_metadata_refs(struct fsck_model *m) {
+    struct superblock *sb = m->sb;
+    struct scan_worker *w = &m->workers[0];
+
+    // Mark essential system blocks as referenced:
+
+    // 1. Superblock (block 1)
+    add_block_ref(w, 0, 0, 1);
+
+    // 2. Log blocks (from logstart to logstart + nlog)
+    for (uint b = sb->logstart; b < sb->logstart + sb->nlog; b++) {
+        if (b < sb->size) add_block_ref(w, 0, 0, b);
+    }
+
+    // 3. Bitmap blocks (from bmapstart to inodestart-1)
+    uint bitmap_blocks = (sb->size + BSIZE*8 - 1) / (BSIZE*8);
+    for (uint b = sb->bmapstart; b < sb->bmapstart + bitmap_blocks && b < sb->size; b++) {
+        add_block_ref(w, 0, 0, b);
+    }
+
+    // 4. Inode blocks (from inodestart to bmapstart-1)
+    uint inode_blocks = (sb->ninodes + IPB - 1) / IPB;
+    for (uint b = sb->inodestart; b < sb->inodestart + inode_blocks && b < sb->size; b++) {
+        add_block_ref(w, 0, 0, b);
+    }
+}
+
+/*
+ * Counts the data blocks of one inode
+ */
+void count_inode_refs(struct scan_worker *w, uint inum) {
+    struct fsck_model *m = w->m;
+    uchar flags = m->itab.flags[inum];
+    if ((flags & (INODE_USED | INODE_HAS_BLOCKS)) != (INODE_USED | INODE_HAS_BLOCKS)) return;
+
+    const uint *addrs = &m->itab.addrs[inum * NDIRECT];
+    for (int i = 0; i < NDIRECT; i++) {
+        if (addrs[i] != 0) add_block_ref(w, inum, i, addrs[i]);
+    }
+    if (m->itab.ind[inum] != 0) {
+        add_block_ref(w, inum, NDIRECT, m->itab.ind[inum]);
+
+        // Visit only the set entries
+        const uint *indirect = m->indirect[inum];
+        if (m->ind_count[inum] <= 0) return;
+        struct addr_masks am;
+        addr_scan(indirect, m->ind_count[inum], m->sb->bmapstart, m->sb->size, NULL, &am);
+        for (int k = 0; k < ADDR_WORDS; k++) {
+            for (uint64 set = am.nonzero[k]; set; set &= set - 1) {
+                int i = k * 64 + __builtin_ctzll(set);
+                add_block_ref(w, inum, NDIRECT + 1 + i, indirect[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Reads the indirect blocks of one range of the inode table.
+ */
+void *scan_inode_range(void *arg) {
+    struct scan_worker *w = arg;
+
+    for (uint inum = w->lo; inum < w->hi; inum++) {
+        if (scan_inode(w, inum) < 0) {
+            w->status = -1;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Reads the directories of one range of the inode table and marks the
+ * inodes they name as referenced.
+ */
+void *scan_dir_range(void *arg) {
+    struct scan_worker *w = arg;
+    struct fsck_model *m = w->m;
+    uint ninodes = m->sb->ninodes;
+
+    // Directory blocks: the dirent graph and parent links
+    for (uint inum = w->lo; inum < w->hi && inum < ninodes; inum++) {
+        if (!(m->itab.flags[inum] & INODE_DIR)) continue;
+
+        m->dir_count[inum] = m->reuse && m->reuse[inum] ? prior_dirents(w, inum) : read_all_dirents(w, inum);
+        if (w->status < 0) return NULL;
+        if (m->dir_count[inum] < 0) continue;
+
+        const struct dirent *entries = m->dir_ents[inum];
+
+        // For each dirent we mark the referred inode as referenced
+        for (int i = 0; i < m->dir_count[inum]; i++) {
+            uint ref_inum = entries[i].inum;
+            if (ref_inum > 0 && ref_inum < ninodes) {
+                bitmap_set_atomic(&m->inode_refs, ref_inum);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Counts the block references of one range of the inode table.
+ */
+void *count_ref_range(void *arg) {
+    struct scan_worker *w = arg;
+    struct fsck_model *m = w->m;
+
+    for (uint inum = w->lo; inum < w->hi && inum < m->sb->ninodes; inum++) {
+        count_inode_refs(w, inum);
+    }
+    if (m->spilling && w->status == 0) spill_flush(w);
+    return NULL;
+}
+
+/*
+ * Returns -1 if any worker ran out of memory, else 0.
+ */
+int workers_status(struct fsck_model *m) {
+    for (int i = 0; i < m->nworkers; i++) {
+        if (m->workers[i].status < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Runs fn on every worker, one thread each (inline when there is only one).
+ * Ranges that can't get a thread are run on the calling thread instead.
+ */
+void run_workers(struct fsck_model *m, void *(*fn)(void *)) {
+    if (m->nworkers == 1) {
+        fn(&m->workers[0]);
+        return;
+    }
+
+    int started = 0;
+    for (; started < m->nworkers; started++) {
+        if (pthread_create(&m->workers[started].thread, NULL, fn, &m->workers[started]) != 0) {
+            break;
+        }
+    }
+    for (int i = started; i < m->nworkers; i++) {
+        fn(&m->workers[i]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(m->workers[i].thread, NULL);
+    }
+}
+
+/*
+ * Splits inodes [1, n) into up to nthreads ranges of whole inode blocks.
+ * Returns 0 on success or -1 if memory ran out.
+ */
+int make_workers(struct fsck_model *m, uint n, int nthreads) {
+    uint nblocks = (n + IPB - 1) / IPB;
+    if (nthreads < 1) nthreads = 1;
+    if ((uint)nthreads > nblocks) nthreads = nblocks;
+    uint per = (nblocks + nthreads - 1) / nthreads * IPB;
+
+    m->workers = calloc(nthreads, sizeof(struct scan_worker));
+    if (!m->workers) {
+        perror("malloc");
+        return -1;
+    }
+    m->nworkers = nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        struct scan_worker *w = &m->workers[i];
+        w->m = m;
+        w->lo = i == 0 ? 1 : i * per;
+        w->hi = (i + 1) * per < n ? (i + 1) * per : n;
+        if (w->lo > w->hi) w->lo = w->hi;
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if a directory entry name is "." or "..", else 0.
+ */
+static inline int is_dot_or_dotdot(const char *name) {
+    return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+/*
+ * Indexes the dirent graph in one pass over all entries: a reverse CSR from
+ * each inode to the directories that name it, and each inode's link count.
+ * Together with the forward lists this answers every parent/child question
+ * in O(dirents) total.
+ * Returns 0 on success or -1 if memory ran out.
+ */
+int build_dir_graph(struct fsck_model *m) {
+    uint n = m->sb->ninodes + 1;
+
+    for (int i = 0; i < m->nworkers; i++) {
+        m->ndirents += m->workers[i].ndirents;
+    }
+
+    m->in_start = calloc(n + 1, sizeof(uint));
+    m->in_src = malloc((m->ndirents ? m->ndirents : 1) * sizeof(uint));
+    m->links = calloc(n, sizeof(uint));
+    m->parents = calloc(n, sizeof(uint));
+    m->namer = calloc(n, sizeof(uint));
+    if (!m->in_start || !m->in_src || !m->links || !m->parents || !m->namer) {
+        perror("malloc");
+        return -1;
+    }
+
+    // Count the entries naming each inode, then turn the counts into offsets
+    for (uint dir = 1; dir < m->sb->ninodes; dir++) {
+        if (!(m->itab.flags[dir] & INODE_DIR) || m->dir_count[dir] < 0) continue;
+
+        const struct dirent *entries = m->dir_ents[dir];
+        for (int i = 0; i < m->dir_count[dir]; i++) {
+            uint inum = entries[i].inum;
+            if (inum >= n) continue;
+            m->in_start[inum + 1]++;
+            m->links[inum] += !(entries[i].name[0] == '.' && entries[i].name[1] == 0);
+            if (!is_dot_or_dotdot(entries[i].name)) {
+                m->parents[inum]++;
+                if (!m->namer[inum]) m->namer[inum] = dir;
+            }
+        }
+    }
+    for (uint i = 0; i < n; i++) {
+        m->in_start[i + 1] += m->in_start[i];
+    }
+
+    // Fill, using in_start[i] as the cursor for inode i; afterwards in_start[i]
+    // holds the start of i+1, which the final pass shifts back into place
+    for (uint dir = 1; dir < m->sb->ninodes; dir++) {
+        if (!(m->itab.flags[dir] & INODE_DIR) || m->dir_count[dir] < 0) continue;
+
+        const struct dirent *entries = m->dir_ents[dir];
+        for (int i = 0; i < m->dir_count[dir]; i++) {
+            if (entries[i].inum < n) m->in_src[m->in_start[entries[i].inum]++] = dir;
+        }
+    }
+    for (uint i = n; i > 0; i--) {
+        m->in_start[i] = m->in_start[i - 1];
+    }
+    m->in_start[0] = 0;
+    return 0;
+}
+
+/*
+ * Releases everything held by the model.
+ */
+void free_model(struct fsck_model *m) {
+    free(m->itab.type);
+    free(m->itab.nlink);
+    free(m->itab.size);
+    free(m->itab.addrs);
+    free(m->itab.ind);
+    free(m->itab.flags);
+    free(m->indirect);
+    free(m->ind_count);
+    for (int i = 0; i < m->nworkers; i++) {
+        arena_free(&m->workers[i].arena);
+        free(m->workers[i].found.list);
+        free(m->workers[i].refs);
+    }
+    free(m->workers);
+    free(m->dir_ents);
+    free(m->dir_count);
+    free(m->dotdot);
+    free(m->in_start);
+    free(m->in_src);
+    free(m->links);
+    free(m->parents);
+    free(m->namer);
+    bitmap_free(&m->reached);
+    free(m->dir_format_ok);
+    free(m->reuse);
+    bitmap_free(&m->inode_refs);
+    refmap_free(&m->block_refs);
+    bitmap_free(&m->block_used);
+    bitmap_free(&m->allocated);
+    if (m->spilling) spill_close(&m->spill);
+    free(m->findings.list);
+    memset(m, 0, sizeof(*m));
+}
+
+const char *fatal_error;  // Why build_model() failed, if it did for a reason other than memory
+
+/*
+ * Queues a block for a prefetch unless an earlier batch already has it.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int prefetch_add(struct read_batch *b, uint blockno) {
+    return btab_lookup(&img.fetched, blockno) ? 0 : batch_add(b, blockno);
+}
+
+/*
+ * Fetches, in one batch, the indirect block of every inode in use. The
+ * fetch only saves reads: a block it misses is read when the scan gets there.
+ */
+void prefetch_indirect(struct fsck_model *m, uint n) {
+    struct read_batch b = { 0 };
+    for (uint inum = 0; inum < n; inum++) {
+        uint ind = m->itab.ind[inum];
+        if (!(m->itab.flags[inum] & INODE_USED) || ind == 0 || ind >= m->sb->size) continue;
+        if (m->reuse && m->reuse[inum]) continue;
+        if (prefetch_add(&b, ind) < 0) break;
+    }
+    batch_read(&b, batch_depth, keep_fetched, NULL);
+    batch_free(&b);
+}
+
+/*
+ * Fetches, in one batch, every block of every directory, direct and indirect,
+ * in the order they sit on disk rather than the order the scan visits them.
+ */
+void prefetch_directories(struct fsck_model *m) {
+    struct read_batch b = { 0 };
+    for (uint inum = 0; inum < m->sb->ninodes; inum++) {
+        if (!(m->itab.flags[inum] & INODE_DIR) || (m->reuse && m->reuse[inum])) continue;
+
+        for (int i = 0; i < NDIRECT; i++) {
+            uint blockno = m->itab.addrs[inum * NDIRECT + i];
+            if (blockno && blockno < m->sb->size && prefetch_add(&b, blockno) < 0) goto out;
+        }
+        for (int i = 0; i < m->ind_count[inum]; i++) {
+            uint blockno = m->indirect[inum][i];
+            if (blockno && blockno < m->sb->size && prefetch_add(&b, blockno) < 0) goto out;
+        }
+    }
+out:
+    batch_read(&b, batch_depth, keep_fetched, NULL);
+    batch_free(&b);
+}
+
+/*
+ * Decodes one inode block's worth of inodes, from inum on, into the columns.
+ */
+void decode_inodes(struct inode_table *t, const struct dinode *dip, uint inum, uint k) {
+    for (uint i = 0; i < k; i++) {
+        t->type[inum + i] = dip[i].type;
+        t->nlink[inum + i] = dip[i].nlink;
+        t->size[inum + i] = dip[i].size;
+        memcpy(&t->addrs[(inum + i) * NDIRECT], dip[i].addrs, NDIRECT * sizeof(uint));
+        t->ind[inum + i] = dip[i].addrs[NDIRECT];
+    }
+}
+
+/*
+ * Derives the per-inode predicates from the columns. Each loop reads one or
+ * two columns front to back without branching.
+ */
+void classify_inodes(struct inode_table *t, struct superblock *sb, uint n) {
+    uint lo = sb->bmapstart, hi = sb->size;
+
+    for (uint i = 0; i < n; i++) {
+        t->flags[i] = (t->type[i] != 0) * INODE_USED | (t->type[i] == T_DIR) * INODE_DIR;
+    }
+    for (uint i = 0; i < n; i++) {
+        const uint *a = &t->addrs[i * NDIRECT];
+        uint x = t->ind[i];
+        uint set = x != 0;
+        uint bad = (x != 0) & ((x < lo) | (x >= hi) | (x == 1));
+        for (int k = 0; k < NDIRECT; k++) {
+            set |= a[k] != 0;
+            bad |= (a[k] != 0) & ((a[k] < lo) | (a[k] >= hi) | (a[k] == 1));
+        }
+        t->flags[i] |= set * INODE_HAS_BLOCKS | bad * INODE_BAD_ADDR |
+                       (set & (t->size[i] == 0)) * INODE_EMPTY_BLOCKS;
+    }
+}
+
+/*
+ * Reads inodes 0..n-1, one inode block at a time, into the columns and classifies them.
+ * Returns 0 on success, -1 on error.
+ */
+int load_inode_table(struct superblock *sb, struct inode_table *t, uint n) {
+    t->type = malloc(n * sizeof(short));
+    t->nlink = malloc(n * sizeof(short));
+    t->size = malloc(n * sizeof(uint));
+    t->addrs = malloc((size_t)n * NDIRECT * sizeof(uint));
+    t->ind = malloc(n * sizeof(uint));
+    t->flags = malloc(n);
+    if (!t->type || !t->nlink || !t->size || !t->addrs || !t->ind || !t->flags) {
+        perror("malloc");
+        return -1;
+    }
+
+    char buf[BSIZE];
+    for (uint inum = 0; inum < n; inum += IPB) {
+        const struct dinode *dip = bview(inum / IPB + sb->inodestart, buf);
+        if (!dip) {
+            fatal_error = "ERROR: failed to read inode block";
+            return -1;
+        }
+        decode_inodes(t, dip, inum, n - inum < IPB ? n - inum : IPB);
+    }
+    classify_inodes(t, sb, n);
+    return 0;
+}
+
+static inline int region_dirty(const struct prior_state *p, uint blockno) {
+    return bitmap_test(&p->dirty, blockno / FP_REGION_BLOCKS);
+}
+
+/*
+ * Marks in m->reuse the inodes that can take what the last run derived for
+ * them: the inode's own block, its indirect block and, for a directory,
+ * every block it lists all lie in regions whose fingerprint is unchanged.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int mark_reusable(struct fsck_model *m, uint n) {
+    struct prior_state *p = m->prior;
+    uint size = m->sb->size;
+    m->reuse = calloc(n, 1);
+    if (!m->reuse) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (uint inum = 0; inum < n; inum++) {
+        uchar flags = m->itab.flags[inum];
+        uint ind = m->itab.ind[inum];
+        int ok = !region_dirty(p, m->sb->inodestart + inum / IPB);
+        if (ok && (flags & INODE_USED) && ind && ind < size) {
+            ok = p->ind_count[inum] == NINDIRECT && !region_dirty(p, ind);
+        }
+        if (ok && (flags & INODE_DIR) && inum < m->sb->ninodes) {
+            ok = p->dir_count[inum] >= 0;
+            for (int i = 0; i < NDIRECT && ok; i++) {
+                uint b = m->itab.addrs[inum * NDIRECT + i];
+                ok = b == 0 || b >= size || !region_dirty(p, b);
+            }
+            for (int i = 0; ind && ind < size && i < NINDIRECT && ok; i++) {
+                uint b = p->indirect[inum][i];
+                ok = b == 0 || b >= size || !region_dirty(p, b);
+            }
+        }
+        m->reuse[inum] = ok;
+        p->reused += ok && (flags & INODE_USED);
+    }
+    return 0;
+}
+
+/*
+ * Builds the model in a single pass: every inode block is read once, then every
+ * indirect block and directory block once. Reference counts are derived in memory.
+ * With nthreads > 1 the inode table is split into ranges scanned in parallel.
+ * With prior (--cache), inodes whose blocks haven't changed take the entries
+ * the last run derived instead of reading their blocks.
+ * Returns 0 on success or -1 on error.
+ */
+int build_model(struct superblock *sb, struct fsck_model *m, int nthreads, struct prior_state *prior) {
+    memset(m, 0, sizeof(*m));
+    m->sb = sb;
+    m->spill.fd = -1;  // not open; fd 0 may be the scratch file if stdin is closed
+    m->prior = prior && prior->n == sb->ninodes + 1 ? prior : NULL;
+
+    uint n = sb->ninodes + 1;
+    m->indirect = calloc(n, sizeof(uint *));
+    m->ind_count = calloc(n, sizeof(int));
+    m->dir_ents = calloc(n, sizeof(struct dirent *));
+    m->dir_count = calloc(n, sizeof(int));
+    m->dotdot = malloc(n * sizeof(int));
+    m->dir_format_ok = calloc(n, 1);
+    if (!m->indirect || !m->ind_count || !m->dir_ents || !m->dir_count || !m->dotdot || !m->dir_format_ok) {
+        perror("malloc");
+        free_model(m);
+        return -1;
+    }
+    m->spilling = mem_limit && block_maps_bytes(sb->size) > mem_limit;
+    if (bitmap_alloc(&m->inode_refs, n) < 0) {
+        free_model(m);
+        return -1;
+    }
+    if (m->spilling ? spill_open(&m->spill) < 0 :
+        refmap_alloc(&m->block_refs, sb->size) < 0 || bitmap_alloc(&m->block_used, sb->size) < 0) {
+        free_model(m);
+        return -1;
+    }
+
+    // Both metadata regions are read front to back
+    uint inode_blocks = (n + IPB - 1) / IPB;
+    uint nbitmap = (sb->size + BPB - 1) / BPB;
+    image_advise(sb->inodestart, inode_blocks, MADV_SEQUENTIAL);
+    image_advise(sb->inodestart, inode_blocks, MADV_WILLNEED);
+    image_advise(sb->bmapstart, nbitmap, MADV_SEQUENTIAL);
+    image_advise(sb->bmapstart, nbitmap, MADV_WILLNEED);
+
+    // The free bitmap is small; load all of it once (unless spilling, when it is read as needed)
+    double t = now_seconds();
+    if (!m->spilling && load_block_bitmap(sb, &m->allocated) < 0) {
+        fatal_error = "ERROR: failed to read bitmap";
+        free_model(m);
+        return -1;
+    }
+    stats.phase[PHASE_BITMAP] += now_seconds() - t;
+
+    t = now_seconds();
+    if (load_inode_table(sb, &m->itab, n) < 0) {
+        free_model(m);
+        return -1;
+    }
+
+    for (uint inum = 0; inum < n; inum++) {
+        m->dotdot[inum] = -1;
+    }
+    if (m->prior && mark_reusable(m, n) < 0) {
+        free_model(m);
+        return -1;
+    }
+
+    if (make_workers(m, n, nthreads) < 0) {
+        free_model(m);
+        return -1;
+    }
+    if (batch_depth && !img.stream) prefetch_indirect(m, n);
+    run_workers(m, scan_inode_range);
+    stats.phase[PHASE_INODE] += now_seconds() - t;
+    if (workers_status(m) < 0) {
+        free_model(m);
+        return -1;
+    }
+
+    t = now_seconds();
+    if (batch_depth && !img.stream) prefetch_directories(m);
+    run_workers(m, scan_dir_range);
+    if (workers_status(m) < 0 || build_dir_graph(m) < 0) {
+        free_model(m);
+        return -1;
+    }
+    stats.phase[PHASE_DIRECTORY] += now_seconds() - t;
+
+    // Spilled references are buffered per worker, within half the limit
+    t = now_seconds();
+    for (int i = 0; i < m->nworkers && m->spilling; i++) {
+        struct scan_worker *w = &m->workers[i];
+        w->maxrefs = mem_limit / 2 / m->nworkers / sizeof(struct ref_tuple);
+        if (w->maxrefs < SPILL_MIN_TUPLES) w->maxrefs = SPILL_MIN_TUPLES;
+        w->refs = malloc((size_t)w->maxrefs * sizeof(struct ref_tuple));
+        if (!w->refs) {
+            perror("malloc");
+            free_model(m);
+            return -1;
+        }
+    }
+    count_metadata_refs(m);
+    run_workers(m, count_ref_range);
+    for (int i = 0; i < m->nworkers && m->spilling; i++) {
+        free(m->workers[i].refs);
+        m->workers[i].refs = NULL;
+    }
+    stats.phase[PHASE_REFERENCE] += now_seconds() - t;
+    if (workers_status(m) < 0) {
+        free_model(m);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Records a finding from a check_all_inodes worker.
+ * Returns -1 if the worker should stop here, 0 to keep checking (--all).
+ */
+int worker_report(struct scan_worker *w, int check, uint inum, uint blockno, const char *msg) {
+    if (add_finding(&w->found, check, inum, blockno, msg) < 0) {
+        w->status = -1;
+        return -1;
+    }
+    return w->m->report_all ? 0 : -1;
+}
+
+/*
+ * Looks a block up in the free bitmap. When spilling the bitmap isn't loaded,
+ * so the bitmap block is read instead; each worker keeps the last one it read.
+ * Returns 1 if allocated, 0 if free, -1 on error.
+ */
+int block_marked(struct scan_worker *w, uint blockno) {
+    struct fsck_model *m = w->m;
+    if (!m->spilling) return is_block_allocated(&m->allocated, blockno);
+    if (blockno >= m->sb->size) return -1;
+    if (blockno == 0) return 0;  // Block 0 is never allocated in the bitmap
+
+    uint bmap = m->sb->bmapstart + blockno / BPB;
+    if (w->bmap_blockno != bmap) {
+        w->bmap_blockno = 0;
+        if (rblock(bmap, w->bmap_buf) < 0) return -1;
+        w->bmap_blockno = bmap;
+    }
+    return (w->bmap_buf[blockno % BPB / 8] >> (blockno % 8)) & 1;
+}
+
+/*
+ * Checks one block address of an inode: it must be a valid data block and be
+ * marked allocated in the bitmap.
+ * Returns -1 if the worker should stop, else 0.
+ */
+int check_block_address(struct scan_worker *w, uint inum, uint blockno) {
+    struct fsck_model *m = w->m;
+
+    if (!is_valid_block(m->sb, blockno)) {
+        return worker_report(w, CHECK_BAD_ADDRESS, inum, blockno, "ERROR: bad address in inode");
+    }
+    int allocated = block_marked(w, blockno);
+    if (allocated < 0) {
+        return worker_report(w, CHECK_IO, inum, blockno, "ERROR: failed to read bitmap");
+    }
+    if (!allocated) {
+        return worker_report(w, CHECK_MARKED_FREE, inum, blockno,
+                             "ERROR: address used by inode but marked free in bitmap");
+    }
+    return 0;
+}
+
+/*
+ * Checks n addresses with the address kernel, then sends the ones it flagged
+ * through check_block_address, in order. Without a loaded bitmap (spilling)
+ * every set address takes that path.
+ * Returns -1 if the worker should stop, else 0.
+ */
+int check_addresses(struct scan_worker *w, uint inum, const uint *a, uint n) {
+    struct fsck_model *m = w->m;
+    const uint *bits = m->spilling ? NULL : (const uint *)m->allocated.words;
+    struct addr_masks am;
+
+    addr_scan(a, n, m->sb->bmapstart, m->sb->size, bits, &am);
+    for (int k = 0; k < ADDR_WORDS; k++) {
+        uint64 slow = bits ? am.bad[k] | am.free[k] : am.nonzero[k];
+        for (; slow; slow &= slow - 1) {
+            if (check_block_address(w, inum, a[k * 64 + __builtin_ctzll(slow)]) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check all blocks referenced by an inode, also verifies blocks are marked allocated in bitmap
+ * Returns -1 if the worker should stop, else 0.
+ */
+int check_inode_blocks(struct scan_worker *w, uint inum) {
+    struct fsck_model *m = w->m;
+
+    // Check direct blocks
+    if (check_addresses(w, inum, &m->itab.addrs[inum * NDIRECT], NDIRECT) < 0) {
+        return -1;
+    }
+
+    // Check indirect block
+    uint ind = m->itab.ind[inum];
+    if (ind != 0) {
+        // The entries of a bad indirect block mean nothing, so don't look at them
+        if (!is_valid_block(m->sb, ind)) {
+            return worker_report(w, CHECK_BAD_ADDRESS, inum, ind, "ERROR: bad address in inode");
+        }
+        if (check_block_address(w, inum, ind) < 0) {
+            return -1;
+        }
+        if (m->ind_count[inum] < 0) {
+            return worker_report(w, CHECK_IO, inum, ind, "ERROR: failed to read indirect block");
+        }
+
+        //Check data blocks
+        if (check_addresses(w, inum, m->indirect[inum], m->ind_count[inum]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Collects the findings for a worker's range of inodes.
+ * The range is extended to include inode ninodes, which this check also covers.
+ */
+void *check_inode_range(void *arg) {
+    struct scan_worker *w = arg;
+    struct fsck_model *m = w->m;
+    uint hi = w->hi == m->sb->ninodes ? w->hi + 1 : w->hi;
+
+    for (uint inum = w->lo; inum < hi; inum++) {
+        // Skip free inodes and those without blocks
+        if ((m->itab.flags[inum] & (INODE_USED | INODE_HAS_BLOCKS)) != (INODE_USED | INODE_HAS_BLOCKS)) continue;
+
+        if (check_inode_blocks(w, inum) < 0) break;
+    }
+    return NULL;
+}
+
+/*
+ * Check all inodes in filesystem, one range per worker. Findings are merged in
+ * range order, so they come out exactly as a serial scan would find them.
+ */
+int check_all_inodes(struct fsck_model *m) {
+    run_workers(m, check_inode_range);
+
+    for (int i = 0; i < m->nworkers; i++) {
+        struct scan_worker *w = &m->workers[i];
+        if (w->status < 0) return -1;
+
+        for (uint k = 0; k < w->found.n; k++) {
+            struct finding *f = &w->found.list[k];
+            if (report(m, f->check, f->inum, f->blockno, f->msg) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Iterates through all in-use inodes.
+ * For each directory, ensures it contains a "." entry pointing to itself
+ * and a ".." entry (but not checking parent validation here).
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_all_directory_formats(struct fsck_model *m) {
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        if (!(m->itab.flags[inum] & INODE_DIR)) {
+            continue; // Skipoing unused or non-directory inodes
+        }
+
+        if (m->dir_count[inum] < 0) {
+            if (report(m, CHECK_IO, inum, 0, "ERROR: failed to read directory entries") < 0) return -1;
+            continue;
+        }
+
+        // Checking "." and ".." for each
+        if (!m->dir_format_ok[inum]) {
+            if (report(m, CHECK_DIR_FORMAT, inum, 0, "ERROR: directory not properly formatted") < 0) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Checks whether the given parent inode contains a directory entry that refers to the specified child inode.
+ * Returns 1 if the parent directory contains a reference to the given child inode.
+ * Returns 0 if not found or -1 on error.
+ */
+int is_child_referenced_in_parent(struct fsck_model *m, uint parent_inum, uint child_inum) {
+    if (!(m->itab.flags[parent_inum] & INODE_DIR))
+        return -1;  // Making sure that parent must be a directory
+
+    if (m->dir_count[parent_inum] < 0){
+        return -1;
+    }
+
+    // Looking through the directories that name the child for the parent
+    for (uint i = m->in_start[child_inum]; i < m->in_start[child_inum + 1]; i++) {
+        if (m->in_src[i] == parent_inum) {
+            return 1;  // Found child in parent
+        }
+    }
+
+    return 0;  // Not found
+}
+
+/*
+ * Verifies that each directory's ".." entry points to the correct parent inode and that parent directory also references that child.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_parent_directory_mismatch(struct fsck_model *m) {
+    // For all inodes in the filesystem
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        // Skip unused inodes or non-directory inodes
+        if (!(m->itab.flags[inum] & INODE_DIR)) {
+            continue;
+        }
+        
+        if (m->dir_count[inum] < 0) {
+            if (report(m, CHECK_IO, inum, 0, "ERROR: failed to read directory entries") < 0) return -1;
+            continue;
+        }
+
+        // Root inode always has itself as ".."
+        if (inum == ROOTINO){
+            continue;
+        }
+
+        // The ".." inode number of the the directory's supposed parent we are checking,
+        // then checking if the claimed parent contains a reference to this directory
+        int parent_inum = m->dotdot[inum];
+        if (parent_inum <= 0 || parent_inum >= m->sb->ninodes ||
+            is_child_referenced_in_parent(m, parent_inum, inum) <= 0) {
+            if (report(m, CHECK_PARENT_MISMATCH, inum, 0, "ERROR: parent directory mismatch") < 0) return -1;
+        }
+    }
+
+    return 0; //if directories all pass
+}
+
+/*
+ * Verifies that each used inode is referenced by at least one directory entry which means that the type!=0
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_used_inode_found_in_directory(struct fsck_model *m) {
+    // Going through inodes
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        // If its in use...
+        if ((m->itab.flags[inum] & INODE_USED) && !bitmap_test(&m->inode_refs, inum)) { // But not marked in the map...
+            if (report(m, CHECK_NOT_IN_DIR, inum, 0, "ERROR: inode marked used but not found in a directory") < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * check_referenced_blocks when spilling: the bitmap is read a block at a time
+ * and every bit set in it is matched against the referenced blocks, which
+ * the merge of the spilled runs hands out in order.
+ * Returns -1 if checking should stop, else 0.
+ */
+int spilled_unreferenced_blocks(struct fsck_model *m) {
+    struct superblock *sb = m->sb;
+    struct spill_merge mg;
+    if (merge_open(&mg, &m->spill, mem_limit) < 0) {
+        return report(m, CHECK_IO, 0, 0, "ERROR: failed to read spilled references") < 0 ? -1 : 0;
+    }
+
+    struct ref_tuple t;
+    int more = merge_next(&mg, &t);
+    int status = 0;
+    uint64 buf[BSIZE / sizeof(uint64)];
+    uint nbitmap = (sb->size + BPB - 1) / BPB;
+    for (uint i = 0; i < nbitmap && status == 0; i++) {
+        const uint64 *words = bview(sb->bmapstart + i, buf);
+        if (!words) {
+            status = report(m, CHECK_IO, 0, sb->bmapstart + i, "ERROR: failed to read bitmap");
+            continue;
+        }
+        for (uint k = 0; k < BSIZE / sizeof(uint64) && status == 0; k++) {
+            uint base = i * BPB + k * 64;
+            if (base >= sb->size) break;
+
+            uint64 bits = words[k];
+            if (sb->size - base < 64) bits &= ((uint64)1 << (sb->size - base)) - 1;
+            if (base == 0) bits &= ~(uint64)1;  // Block 0 is reserved for boot
+            for (; bits && status == 0; bits &= bits - 1) {
+                uint b = base + __builtin_ctzll(bits);
+                while (more > 0 && t.blockno < b) more = merge_next(&mg, &t);
+                if (more < 0) {
+                    status = report(m, CHECK_IO, 0, 0, "ERROR: failed to read spilled references");
+                    more = 0;
+                } else if (!more || t.blockno != b) {
+                    status = report(m, CHECK_BITMAP_UNUSED, 0, b, "ERROR: bitmap marks block in use but it is not in use");
+                }
+            }
+        }
+    }
+    merge_close(&mg);
+    return status;
+}
+
+/*
+ * Verify all blocks marked in-use in bitmap are actually referenced
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_referenced_blocks(struct fsck_model *m) {
+    if (m->spilling) return spilled_unreferenced_blocks(m);
+
+    // Block 0 is reserved for boot and never counts as allocated
+    long blockno = bitmap_next_unreferenced(&m->allocated, &m->block_used, 1);
+
+    // Error if block is allocated in bitmap but not referenced anywhere
+    for (; blockno >= 0; blockno = bitmap_next_unreferenced(&m->allocated, &m->block_used, blockno + 1)) {
+        if (report(m, CHECK_BITMAP_UNUSED, 0, blockno, "ERROR: bitmap marks block in use but it is not in use") < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Finds which inodes hold the extra references to the shared blocks in dup and
+ * reports one finding per extra reference. Only run once a shared block has
+ * been found, so a clean image never pays for it.
+ * Returns -1 if checking should stop, else 0.
+ */
+int report_shared_blocks(struct fsck_model *m, struct bitmap *dup) {
+    struct bitmap seen;
+    if (bitmap_alloc(&seen, m->sb->size) < 0) return -1;
+
+    int status = 0;
+    for (uint inum = 1; inum < m->sb->ninodes && status == 0; inum++) {
+        if (!(m->itab.flags[inum] & INODE_USED)) continue;
+
+        const uint *addrs = &m->itab.addrs[inum * NDIRECT];
+        const uint *ind = m->indirect[inum];
+        int nind = m->ind_count[inum] > 0 ? m->ind_count[inum] : 0;
+        for (int i = 0; i < NDIRECT + 1 + nind && status == 0; i++) {
+            uint b = i < NDIRECT ? addrs[i] : i == NDIRECT ? m->itab.ind[inum] : ind[i - NDIRECT - 1];
+            if (b == 0 || b >= m->sb->size || !bitmap_test(dup, b)) continue;
+
+            if (bitmap_test(&seen, b)) {
+                status = report(m, CHECK_MULTIPLY_USED, inum, b, "ERROR: address used more than once");
+            }
+            bitmap_set(&seen, b);
+        }
+    }
+    bitmap_free(&seen);
+    return status;
+}
+
+int cmp_holder(const void *a, const void *b) {
+    const struct ref_tuple *x = a, *y = b;
+    if (x->inum != y->inum) return x->inum < y->inum ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/*
+ * check_multiply_referenced_blocks when spilling. In the merged order the
+ * references to a block are adjacent and sorted by inode and slot, so each
+ * inode reference after the first is an extra one. The extras are reported
+ * by inode and slot, the order report_shared_blocks finds them in.
+ * Returns -1 if checking should stop, else 0.
+ */
+int spilled_shared_blocks(struct fsck_model *m, uint start_block) {
+    struct spill_merge mg;
+    if (merge_open(&mg, &m->spill, mem_limit) < 0) {
+        return report(m, CHECK_IO, 0, 0, "ERROR: failed to read spilled references") < 0 ? -1 : 0;
+    }
+
+    struct ref_tuple t, *extra = NULL;
+    uint nextra = 0, cap = 0;
+    uint last = 0;  // block of the last inode reference
+    int more;
+    while ((more = merge_next(&mg, &t)) > 0) {
+        if (t.inum == 0 || t.blockno < start_block) continue;
+        if (t.blockno == last) {
+            if (grow_array((void **)&extra, &cap, nextra + 1, sizeof(*extra)) < 0) {
+                more = -1;
+                break;
+            }
+            extra[nextra++] = t;
+        }
+        last = t.blockno;
+    }
+    merge_close(&mg);
+
+    int status = 0;
+    if (more < 0) {
+        status = report(m, CHECK_IO, 0, 0, "ERROR: failed to read spilled references");
+    } else {
+        if (nextra) qsort(extra, nextra, sizeof(*extra), cmp_holder);
+        for (uint i = 0; i < nextra && status == 0; i++) {
+            status = report(m, CHECK_MULTIPLY_USED, extra[i].inum, extra[i].blockno, "ERROR: address used more than once");
+        }
+    }
+    free(extra);
+    return status;
+}
+
+/*
+ * Verify no block is referenced by more than one inode
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_multiply_referenced_blocks(struct fsck_model *m) {
+    struct superblock *sb = m->sb;
+
+    // Only check data blocks (after inode blocks)
+    uint start_block = sb->inodestart + ((sb->ninodes + IPB - 1) / IPB);
+    if (m->spilling) return spilled_shared_blocks(m, start_block);
+
+    // Scan all data blocks (from start_block to sb->size - 1)
+    long blockno = refmap_next_shared(&m->block_refs, start_block);
+    if (blockno < 0) return 0;
+
+    struct bitmap dup;
+    if (bitmap_alloc(&dup, sb->size) < 0) return -1;
+    for (; blockno >= 0; blockno = refmap_next_shared(&m->block_refs, blockno + 1)) {
+        bitmap_set(&dup, blockno);
+    }
+    int status = report_shared_blocks(m, &dup);
+    bitmap_free(&dup);
+    return status;
+}
+
+/*
+ * Verifies that each inode referenced in any directory is actually marked in-use.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_dirent_refers_to_allocated_inode(struct fsck_model *m) {
+    // Check all inodes that are referenced in directories
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        // If this inode was referenced, here we make sure it's actually in use
+        if (bitmap_test(&m->inode_refs, inum) && !(m->itab.flags[inum] & INODE_USED)) {
+            if (report(m, CHECK_REFERS_TO_FREE, inum, 0, "ERROR: inode referred to in directory but marked free") < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Verifies that each used inode's nlink is the number of directory entries
+ * naming it. As in xv6, "." is not a link and ".." is one: a directory has
+ * one for its own name and one for each subdirectory.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_link_counts(struct fsck_model *m) {
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        if ((m->itab.flags[inum] & INODE_USED) && (uint)(ushort)m->itab.nlink[inum] != m->links[inum]) {
+            if (report(m, CHECK_LINK_COUNT, inum, 0, "ERROR: inode link count does not match directory entries") < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the number of blocks an inode's addresses cover: one past the last
+ * one set, in file order. Returns -1 if its indirect block couldn't be read.
+ */
+int inode_block_span(struct fsck_model *m, uint inum) {
+    if (m->itab.ind[inum] != 0) {
+        if (m->ind_count[inum] <= 0) return -1;
+
+        struct addr_masks am;
+        addr_scan(m->indirect[inum], m->ind_count[inum], m->sb->bmapstart, m->sb->size, NULL, &am);
+        for (int k = ADDR_WORDS - 1; k >= 0; k--) {
+            if (am.nonzero[k]) return NDIRECT + k * 64 + 64 - __builtin_clzll(am.nonzero[k]);
+        }
+    }
+
+    const uint *addrs = &m->itab.addrs[inum * NDIRECT];
+    int span = NDIRECT;
+    while (span > 0 && addrs[span - 1] == 0) span--;
+    return span;
+}
+
+/*
+ * Verifies that no used inode has a block past its size: one set at or after
+ * index ceil(size / BSIZE) in file order. xv6's bmap allocates blocks only
+ * as they are written, so a size beyond the blocks (holes, or a directory
+ * rounded up by mkfs) is legal; a block past the end never is.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_inode_sizes(struct fsck_model *m) {
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        if (!(m->itab.flags[inum] & INODE_USED)) continue;
+
+        int span = inode_block_span(m, inum);
+        if (span < 0) continue;  // check_all_inodes reported the unreadable indirect block
+        if ((uint64)span > ((uint64)m->itab.size[inum] + BSIZE - 1) / BSIZE) {
+            if (report(m, CHECK_SIZE_MISMATCH, inum, 0, "ERROR: inode has blocks past its size") < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * FNV-1a over a directory entry name, up to its NUL or DIRSIZ bytes.
+ */
+uint name_hash(const char *name) {
+    uint h = 2166136261u;
+    for (int i = 0; i < DIRSIZ && name[i]; i++) {
+        h = (h ^ (uchar)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Verifies that no directory names two entries the same, by putting each
+ * directory's names in an open-addressing hash table of entry indexes
+ * (-1 for empty), one table reused for every directory. One finding per
+ * entry that repeats an earlier name.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_duplicate_names(struct fsck_model *m) {
+    int *slots = NULL;
+    uint cap = 0;
+    int status = 0;
+
+    for (uint dir = 1; dir < m->sb->ninodes && status == 0; dir++) {
+        if (!(m->itab.flags[dir] & INODE_DIR) || m->dir_count[dir] <= 1) continue;
+
+        const struct dirent *entries = m->dir_ents[dir];
+        uint need = 2;
+        while (need < 2 * (uint)m->dir_count[dir]) need *= 2;
+        if (need > cap) {
+            free(slots);
+            slots = malloc(need * sizeof(int));
+            if (!slots) {
+                perror("malloc");
+                return -1;
+            }
+            cap = need;
+        }
+        memset(slots, 0xff, need * sizeof(int));
+
+        for (int k = 0; k < m->dir_count[dir] && status == 0; k++) {
+            uint i = name_hash(entries[k].name) & (need - 1);
+            while (slots[i] >= 0 && strncmp(entries[slots[i]].name, entries[k].name, DIRSIZ) != 0) {
+                i = (i + 1) & (need - 1);
+            }
+            if (slots[i] < 0) {
+                slots[i] = k;
+            } else {
+                status = report(m, CHECK_DUPLICATE_NAME, dir, 0, "ERROR: duplicate name in directory");
+            }
+        }
+    }
+    free(slots);
+    return status;
+}
+
+/*
+ * Queues a directory at the bottom of a deque.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int deque_push(struct dir_deque *q, uint dir) {
+    int status = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom == q->cap && q->top > 0) {
+        memmove(q->items, q->items + q->top, (q->bottom - q->top) * sizeof(uint));
+        q->bottom -= q->top;
+        q->top = 0;
+    }
+    if (grow_array((void **)&q->items, &q->cap, q->bottom + 1, sizeof(uint)) < 0) {
+        status = -1;
+    } else {
+        q->items[q->bottom++] = dir;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return status;
+}
+
+/*
+ * Takes a directory from the bottom of a deque (its owner) or the top (a thief).
+ * Returns 1 if there was one, else 0.
+ */
+int deque_take(struct dir_deque *q, int steal, uint *dir) {
+    int got = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        *dir = steal ? q->items[q->top++] : q->items[--q->bottom];
+        got = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+/*
+ * Marks what one directory names as reached and queues its subdirectories.
+ * Returns -1 if memory ran out, else 0.
+ */
+int walk_dir(struct scan_worker *w, uint dir) {
+    struct fsck_model *m = w->m;
+    const struct dirent *entries = m->dir_ents[dir];
+
+    for (int k = 0; k < m->dir_count[dir]; k++) {
+        uint inum = entries[k].inum;
+        if (inum >= m->sb->ninodes || is_dot_or_dotdot(entries[k].name)) continue;
+        if (bitmap_test_and_set_atomic(&m->reached, inum)) continue;
+
+        if ((m->itab.flags[inum] & INODE_DIR) && m->dir_count[inum] > 0) {
+            __atomic_add_fetch(&m->walk_pending, 1, __ATOMIC_SEQ_CST);
+            if (deque_push(&w->deque, inum) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+void *walk_range(void *arg) {
+    struct scan_worker *w = arg;
+    struct fsck_model *m = w->m;
+    int self = w - m->workers;
+
+    while (!__atomic_load_n(&m->walk_failed, __ATOMIC_RELAXED)) {
+        uint dir;
+        int got = deque_take(&w->deque, 0, &dir);
+        for (int i = 1; !got && i < m->nworkers; i++) {
+            got = deque_take(&m->workers[(self + i) % m->nworkers].deque, 1, &dir);
+        }
+        if (!got) {
+            if (__atomic_load_n(&m->walk_pending, __ATOMIC_SEQ_CST) == 0) break;
+            sched_yield();
+            continue;
+        }
+        if (walk_dir(w, dir) < 0) {
+            __atomic_store_n(&m->walk_failed, 1, __ATOMIC_RELAXED);
+            w->status = -1;
+        }
+        __atomic_sub_fetch(&m->walk_pending, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/*
+ * Walks the tree from the root, filling m->reached.
+ * Returns 0 on success, -1 if memory ran out.
+ */
+int walk_from_root(struct fsck_model *m) {
+    if (bitmap_alloc(&m->reached, m->sb->ninodes + 1) < 0) return -1;
+    bitmap_set(&m->reached, ROOTINO);
+    if (!(m->itab.flags[ROOTINO] & INODE_DIR) || m->dir_count[ROOTINO] <= 0) return 0;
+
+    for (int i = 0; i < m->nworkers; i++) {
+        pthread_mutex_init(&m->workers[i].deque.lock, NULL);
+    }
+    m->walk_pending = 1;
+    m->walk_failed = deque_push(&m->workers[0].deque, ROOTINO) < 0;
+    run_workers(m, walk_range);
+
+    for (int i = 0; i < m->nworkers; i++) {
+        struct dir_deque *q = &m->workers[i].deque;
+        pthread_mutex_destroy(&q->lock);
+        free(q->items);
+        memset(q, 0, sizeof(*q));
+    }
+    return m->walk_failed ? -1 : 0;
+}
+
+/*
+ * Verifies that every used inode some directory names can be reached from
+ * the root. One that no directory names is check 7's; one reported here
+ * hangs off a directory that is itself cut off, or lies in a cycle.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_reachable(struct fsck_model *m) {
+    if (walk_from_root(m) < 0) return -1;
+
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        if ((m->itab.flags[inum] & INODE_USED) && bitmap_test(&m->inode_refs, inum) &&
+            !bitmap_test(&m->reached, inum)) {
+            if (report(m, CHECK_UNREACHABLE, inum, 0, "ERROR: inode not reachable from root") < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Verifies that each directory is named once, other than as "." or "..",
+ * and the root not at all.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_multiple_parents(struct fsck_model *m) {
+    for (uint inum = 1; inum < m->sb->ninodes; inum++) {
+        if (!(m->itab.flags[inum] & INODE_DIR)) continue;
+        if (m->parents[inum] > (inum == ROOTINO ? 0 : 1)) {
+            if (report(m, CHECK_MULTIPLE_PARENTS, inum, 0, "ERROR: directory has more than one parent") < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finds the directory cycles cut off from the root. Following namer from a
+ * directory the walk didn't reach either ends at one no directory names, or
+ * comes back round; each such cycle is reported once, by its lowest inode.
+ * state is 0 for not yet followed, 1 on the current path, 2 done.
+ * Returns -1 if checking should stop, else 0.
+ */
+int check_directory_cycles(struct fsck_model *m) {
+    uint n = m->sb->ninodes;
+    char *state = calloc(n, 1);
+    if (!state) {
+        perror("malloc");
+        return -1;
+    }
+
+    int status = 0;
+    for (uint start = 1; start < n && status == 0; start++) {
+        uint d = start;
+        while (d && d < n && state[d] == 0 && (m->itab.flags[d] & INODE_DIR) && !bitmap_test(&m->reached, d)) {
+            state[d] = 1;
+            d = m->namer[d];
+        }
+        if (d && d < n && state[d] == 1) {
+            uint low = d;
+            for (uint c = m->namer[d]; c != d; c = m->namer[c]) {
+                if (c < low) low = c;
+            }
+            status = report(m, CHECK_DIR_CYCLE, low, 0, "ERROR: directory cycle not reachable from root");
+        }
+        for (d = start; d && d < n && state[d] == 1; d = m->namer[d]) {
+            state[d] = 2;
+        }
+    }
+    free(state);
+    return status;
+}
+
+/*
+ * Runs every check against the model, in the order their errors are reported.
+ * Stops at the first finding unless report_all is set.
+ * Returns 0 if the filesystem is consistent, else -1.
+ */
+int run_checks(struct fsck_model *m) {
+    static const struct {
+        int (*fn)(struct fsck_model *);
+        int phase;
+    } checks[] = {
+        { check_all_inodes, PHASE_INODE },
+        { check_all_directory_formats, PHASE_DIRECTORY },
+        { check_dirent_refers_to_allocated_inode, PHASE_REFERENCE },
+        { check_multiply_referenced_blocks, PHASE_REFERENCE },
+        { check_referenced_blocks, PHASE_BITMAP },
+        { check_used_inode_found_in_directory, PHASE_REFERENCE },
+        { check_parent_directory_mismatch, PHASE_DIRECTORY },
+        { check_link_counts, PHASE_REFERENCE },
+        { check_inode_sizes, PHASE_INODE },
+        { check_duplicate_names, PHASE_DIRECTORY },
+        { check_reachable, PHASE_DIRECTORY },
+        { check_multiple_parents, PHASE_DIRECTORY },
+        { check_directory_cycles, PHASE_DIRECTORY },
+    };
+
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        double t = now_seconds();
+        int r = checks[i].fn(m);
+        stats.phase[checks[i].phase] += now_seconds() - t;
+        if (r < 0) return -1;
+    }
+    return m->findings.n ? -1 : 0;
+}
+
+/*
+ * Finds the first directory that names inum other than as "." or "..".
+ * Returns that directory and points *name at the entry's name, or returns 0.
+ */
+uint named_by(struct fsck_model *m, uint inum, const char **name) {
+    for (uint i = m->in_start[inum]; i < m->in_start[inum + 1]; i++) {
+        uint dir = m->in_src[i];
+        const struct dirent *entries = m->dir_ents[dir];
+        for (int k = 0; k < m->dir_count[dir]; k++) {
+            if (entries[k].inum == inum && strncmp(entries[k].name, ".", DIRSIZ) != 0 &&
+                strncmp(entries[k].name, "..", DIRSIZ) != 0) {
+                *name = entries[k].name;
+                return dir;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the path of an inode into buf by following the dirent graph up to
+ * the root, e.g. "/dir/file". Uses "?" for a part that can't be named
+ * (no directory names it, or the chain loops).
+ */
+void inode_path(struct fsck_model *m, uint inum, char *buf, size_t len) {
+    const char *names[64];
+    int depth = 0;
+
+    while (inum != ROOTINO && inum <= m->sb->ninodes && depth < 64) {
+        const char *name;
+        uint parent = named_by(m, inum, &name);
+        if (!parent) break;
+        names[depth++] = name;
+        inum = parent;
+    }
+
+    if (inum == ROOTINO && depth == 0) {
+        snprintf(buf, len, "/");
+        return;
+    }
+    size_t off = snprintf(buf, len, "%s", inum == ROOTINO ? "" : "?");
+    for (int i = depth - 1; i >= 0 && off < len; i--) {
+        off += snprintf(buf + off, len - off, "/%.*s", DIRSIZ, names[i]);
+    }
+}
+
+/*
+ * Repair (-y). Fixes are never written as they are made: every block a fix
+ * touches is copied once into a write set and changed there, later fixes see
+ * the changed copies, and the whole set is written back in ascending block
+ * order, coalesced into runs, with a single fsync at the end.
+ */
+#define WS_RUN_BLOCKS 256  // most blocks one pwritev writes
+
+/*
+ * Returns a block as the repairs so far have left it.
+ */
+const void *ws_view(struct block_table *ws, uint blockno, void *buf) {
+    char *p = btab_lookup(ws, blockno);
+    return p ? p : bview(blockno, buf);
+}
+
+/*
+ * Returns a writable copy of a block, read from the image on first touch.
+ * Returns NULL if the block can't be read or memory ran out.
+ */
+char *ws_block(struct block_table *ws, uint blockno) {
+    char *p = btab_lookup(ws, blockno);
+    if (p) return p;
+
+    p = btab_insert(ws, blockno);
+    if (!p || rblock(blockno, p) < 0) return NULL;
+    return p;
+}
+
+int cmp_slot(const void *a, const void *b) {
+    uint x = ((const struct table_slot *)a)->blockno, y = ((const struct table_slot *)b)->blockno;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes the set back in ascending block order, one pwritev per run of
+ * consecutive blocks, then syncs the image once.
+ * Returns the number of blocks written or -1 on error.
+ */
+long ws_flush(struct block_table *ws) {
+    if (ws->n == 0) return 0;
+
+    // Pack the used slots to the front and sort them
+    uint n = 0;
+    for (uint i = 0; i < ws->cap; i++) {
+        if (ws->slots[i].data) ws->slots[n++] = ws->slots[i];
+    }
+    qsort(ws->slots, n, sizeof(struct table_slot), cmp_slot);
+
+    struct iovec iov[WS_RUN_BLOCKS];
+    for (uint i = 0; i < n; ) {
+        uint run = 0;
+        while (i + run < n && run < WS_RUN_BLOCKS && ws->slots[i + run].blockno == ws->slots[i].blockno + run) {
+            iov[run].iov_base = ws->slots[i + run].data;
+            iov[run].iov_len = BSIZE;
+            run++;
+        }
+        ssize_t want = (ssize_t)run * BSIZE;
+        count_io(0, 1);
+        if (pwritev(img.fd, iov, run, (off_t)ws->slots[i].blockno * BSIZE) != want) {
+            perror("pwritev");
+            return -1;
+        }
+        i += run;
+    }
+
+    count_io(0, 1);
+    if (fsync(img.fd) < 0) {
+        perror("fsync");
+        return -1;
+    }
+    return n;
+}
+
+struct repair {
+    struct fsck_model *m;
+    struct block_table ws;
+    struct bitmap used;     // blocks that can't be handed out: referenced, metadata or taken by a fix
+    uint next_free;         // where the search for a free block resumes
+    uint *parent;           // the parent each directory is left with, else 0
+    struct bitmap dots_gone;    // directories whose "." or ".." a fix has cleared
+    struct bitmap reached;  // inodes the root reaches through the repaired directories
+    uint lost_found;        // 0 until a lost+found is needed
+    uint fixes;             // changes made
+};
+
+/*
+ * Returns an inode as the repairs so far have left it. One they haven't
+ * touched comes from the model's table, which doesn't keep major and minor.
+ */
+struct dinode rep_inode(struct repair *r, uint inum) {
+    char *p = btab_lookup(&r->ws, IBLOCK(inum, (*r->m->sb)));
+    if (p) return ((const struct dinode *)p)[inum % IPB];
+
+    const struct inode_table *t = &r->m->itab;
+    struct dinode d = { .type = t->type[inum], .nlink = t->nlink[inum], .size = t->size[inum] };
+    memcpy(d.addrs, &t->addrs[inum * NDIRECT], NDIRECT * sizeof(uint));
+    d.addrs[NDIRECT] = t->ind[inum];
+    return d;
+}
+
+/*
+ * Returns a writable copy of an inode, or NULL on error.
+ */
+struct dinode *rep_inode_w(struct repair *r, uint inum) {
+    char *p = ws_block(&r->ws, IBLOCK(inum, (*r->m->sb)));
+    return p ? (struct dinode *)p + inum % IPB : NULL;
+}
+
+/*
+ * Returns the entries of an inode's indirect block as the repairs so far have
+ * left them, or NULL if it has none that can be read.
+ */
+const uint *rep_indirect(struct repair *r, uint inum, void *buf) {
+    uint ind = rep_inode(r, inum).addrs[NDIRECT];
+    if (ind == 0 || !is_valid_block(r->m->sb, ind)) return NULL;
+
+    char *p = btab_lookup(&r->ws, ind);
+    if (p) return (const uint *)p;
+    if (ind == r->m->itab.ind[inum] && r->m->ind_count[inum] > 0) {
+        return r->m->indirect[inum];
+    }
+    return bview(ind, buf);
+}
+
+/*
+ * Fills blocks[MAXFILE] with an inode's block addresses in file order, 0 for holes.
+ */
+void rep_blocks(struct repair *r, uint inum, uint *blocks) {
+    struct dinode dip = rep_inode(r, inum);
+    char buf[BSIZE];
+    const uint *ind = rep_indirect(r, inum, buf);
+
+    for (int k = 0; k < NDIRECT; k++) blocks[k] = dip.addrs[k];
+    for (int k = 0; k < NINDIRECT; k++) blocks[NDIRECT + k] = ind ? ind[k] : 0;
+}
+
+/*
+ * Takes a data block no one uses, zeroed in the write set.
+ * Returns its number, or 0 if the image is full.
+ */
+uint rep_alloc_block(struct repair *r) {
+    struct superblock *sb = r->m->sb;
+    if (r->next_free == 0) r->next_free = sb->bmapstart + (sb->size + BPB - 1) / BPB;
+
+    for (; r->next_free < sb->size; r->next_free++) {
+        if (bitmap_test(&r->used, r->next_free)) continue;
+
+        uint b = r->next_free++;
+        char *p = ws_block(&r->ws, b);
+        if (!p) return 0;
+        memset(p, 0, BSIZE);
+        bitmap_set(&r->used, b);
+        return b;
+    }
+    return 0;
+}
+
+/*
+ * Clears the addresses of an inode that point outside the data blocks.
+ * A bad indirect block is dropped whole.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_bad_addresses(struct repair *r, uint inum) {
+    struct superblock *sb = r->m->sb;
+    struct dinode dip = rep_inode(r, inum);
+
+    for (int i = 0; i <= NDIRECT; i++) {
+        if (dip.addrs[i] != 0 && !is_valid_block(sb, dip.addrs[i])) {
+            struct dinode *w = rep_inode_w(r, inum);
+            if (!w) return -1;
+            w->addrs[i] = 0;
+            r->fixes++;
+        }
+    }
+
+    char buf[BSIZE];
+    const uint *ind = rep_indirect(r, inum, buf);
+    for (int i = 0; ind && i < NINDIRECT; i++) {
+        if (ind[i] != 0 && !is_valid_block(sb, ind[i])) {
+            uint *w = (uint *)ws_block(&r->ws, dip.addrs[NDIRECT]);
+            if (!w) return -1;
+            w[i] = 0;
+            ind = w;
+            r->fixes++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Gives every extra reference to a shared block its own copy, walking the
+ * inodes in the order check_multiply_referenced_blocks reports them. An
+ * indirect block that is shared is dropped from the later inode instead, as
+ * copying it would only share its entries.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_shared_blocks(struct repair *r) {
+    struct fsck_model *m = r->m;
+    struct bitmap seen;
+    if (bitmap_alloc(&seen, m->sb->size) < 0) return -1;
+
+    int status = 0;
+    for (uint inum = 1; inum < m->sb->ninodes && status == 0; inum++) {
+        if (rep_inode(r, inum).type == 0) continue;
+
+        uint blocks[MAXFILE];
+        rep_blocks(r, inum, blocks);
+        uint ind = rep_inode(r, inum).addrs[NDIRECT];
+
+        for (int k = 0; k < NDIRECT + 1 + NINDIRECT && status == 0; k++) {
+            uint b = k < NDIRECT ? blocks[k] : k == NDIRECT ? ind : blocks[k - 1];
+            if (b == 0 || !is_valid_block(m->sb, b)) continue;
+            if (!bitmap_test(&seen, b)) {
+                bitmap_set(&seen, b);
+                continue;
+            }
+
+            uint copy = k == NDIRECT ? 0 : rep_alloc_block(r);
+            char buf[BSIZE];
+            const void *data = ws_view(&r->ws, b, buf);
+            if (copy && data) memcpy(btab_lookup(&r->ws, copy), data, BSIZE);
+
+            if (k <= NDIRECT) {
+                struct dinode *w = rep_inode_w(r, inum);
+                if (!w) status = -1;
+                else w->addrs[k] = copy;
+                if (k == NDIRECT) break;  // its entries went with it
+            } else {
+                uint *w = (uint *)ws_block(&r->ws, ind);
+                if (!w) status = -1;
+                else w[k - 1 - NDIRECT] = copy;
+            }
+            if (copy) bitmap_set(&seen, copy);
+            r->fixes++;
+        }
+    }
+    bitmap_free(&seen);
+    return status;
+}
+
+/*
+ * Adds an entry to a directory, in its first free slot or in a new block.
+ * Returns 0 on success or -1 if the directory has no room or on error.
+ */
+int rep_dir_add(struct repair *r, uint dir, const char *name, uint inum) {
+    // The name field is DIRSIZ bytes and is not terminated when full
+    size_t len = strlen(name);
+    if (len > DIRSIZ) return -1;
+
+    uint blocks[MAXFILE];
+    rep_blocks(r, dir, blocks);
+
+    for (int k = 0; k < NDIRECT + NINDIRECT; k++) {
+        uint b = blocks[k];
+        if (b == 0) {
+            // Only a direct slot can be filled without an indirect block
+            if (k >= NDIRECT || !(b = rep_alloc_block(r))) return -1;
+            struct dinode *w = rep_inode_w(r, dir);
+            if (!w) return -1;
+            w->addrs[k] = b;
+        }
+
+        char buf[BSIZE];
+        const struct dirent *view = ws_view(&r->ws, b, buf);
+        if (!view) continue;
+        for (uint i = 0; i < DPB; i++) {
+            if (view[i].inum != 0) continue;
+
+            struct dirent *de = (struct dirent *)ws_block(&r->ws, b);
+            if (!de) return -1;
+            memset(&de[i], 0, sizeof(de[i]));
+            de[i].inum = inum;
+            memcpy(de[i].name, name, len);
+
+            uint end = (k * DPB + i + 1) * sizeof(struct dirent);
+            if (rep_inode(r, dir).size < end) {
+                struct dinode *w = rep_inode_w(r, dir);
+                if (!w) return -1;
+                w->size = end;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Clears the entries of a directory that name inum other than as "." or
+ * "..", past the first keep of them.
+ * Returns 0 on success or -1 on error.
+ */
+int rep_dir_unlink(struct repair *r, uint dir, uint inum, uint keep) {
+    uint blocks[MAXFILE];
+    rep_blocks(r, dir, blocks);
+
+    for (int k = 0; k < NDIRECT + NINDIRECT; k++) {
+        if (blocks[k] == 0 || blocks[k] >= r->m->sb->size) continue;
+
+        char buf[BSIZE];
+        const struct dirent *view = ws_view(&r->ws, blocks[k], buf);
+        if (!view) continue;
+        for (uint i = 0; i < DPB; i++) {
+            if (view[i].inum != inum || is_dot_or_dotdot(view[i].name)) continue;
+            if (keep > 0) {
+                keep--;
+                continue;
+            }
+
+            struct dirent *w = (struct dirent *)ws_block(&r->ws, blocks[k]);
+            if (!w) return -1;
+            w[i].inum = 0;
+            view = w;
+            r->fixes++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the inode of lost+found, creating it in the root if there is none.
+ * Returns 0 if it can't be had.
+ */
+uint lost_found(struct repair *r) {
+    struct fsck_model *m = r->m;
+    if (r->lost_found) return r->lost_found;
+
+    const struct dirent *entries = m->dir_ents[ROOTINO];
+    for (int k = 0; k < m->dir_count[ROOTINO]; k++) {
+        uint inum = entries[k].inum;
+        if (strncmp(entries[k].name, "lost+found", DIRSIZ) == 0 && inum < m->sb->ninodes &&
+            rep_inode(r, inum).type == T_DIR) {
+            return r->lost_found = inum;
+        }
+    }
+
+    // A free inode no directory names
+    uint inum = ROOTINO + 1;
+    while (inum < m->sb->ninodes && (rep_inode(r, inum).type != 0 || bitmap_test(&m->inode_refs, inum))) {
+        inum++;
+    }
+    if (inum >= m->sb->ninodes) return 0;
+
+    struct dinode *dip = rep_inode_w(r, inum);
+    if (!dip) return 0;
+    memset(dip, 0, sizeof(*dip));
+    dip->type = T_DIR;
+    dip->nlink = 1;
+    if (rep_dir_add(r, inum, ".", inum) < 0 || rep_dir_add(r, inum, "..", ROOTINO) < 0 ||
+        rep_dir_add(r, ROOTINO, "lost+found", inum) < 0) {
+        return 0;
+    }
+    struct dinode *root = rep_inode_w(r, ROOTINO);
+    if (!root) return 0;
+    root->nlink++;
+    r->fixes++;
+    return r->lost_found = inum;
+}
+
+/*
+ * Links an inode the root can't reach into lost+found as "#inum", or into
+ * the root if there is no free inode to make lost+found from. Directories
+ * get their ".." pointed there by fix_directory. An inode the root still
+ * reaches is left alone, and one that can't be linked is freed.
+ * Returns 0 on success or -1 on error.
+ */
+int adopt(struct repair *r, uint inum) {
+    if (bitmap_test(&r->reached, inum)) return 0;
+
+    char name[DIRSIZ + 1];
+    snprintf(name, sizeof(name), "#%u", inum);
+
+    uint lf = lost_found(r);
+    if (!lf) lf = ROOTINO;
+    if (rep_dir_add(r, lf, name, inum) == 0) {
+        if (rep_inode(r, inum).type == T_DIR) {
+            struct dinode *w = rep_inode_w(r, lf);
+            if (!w) return -1;
+            w->nlink++;
+            r->parent[inum] = lf;
+        }
+    } else {
+        struct dinode *w = rep_inode_w(r, inum);
+        if (!w) return -1;
+        memset(w, 0, sizeof(*w));
+    }
+    r->fixes++;
+    return 0;
+}
+
+/*
+ * Leaves a directory named by one parent only. A reached directory keeps the
+ * one its ".." names if that one is reached and names it back, else the
+ * first reached one that names it; a cut-off directory keeps the one
+ * check_directory_cycles follows. The root keeps none.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_multiple_parents(struct repair *r, uint inum) {
+    struct fsck_model *m = r->m;
+    uint keep = 0;
+
+    if (inum != ROOTINO && bitmap_test(&m->reached, inum)) {
+        int dd = m->dotdot[inum];
+        if (dd > 0 && dd < m->sb->ninodes && dd != inum && bitmap_test(&m->reached, dd) &&
+            is_child_referenced_in_parent(m, dd, inum) > 0) {
+            keep = dd;
+        }
+        for (uint i = m->in_start[inum]; i < m->in_start[inum + 1] && !keep; i++) {
+            uint dir = m->in_src[i];
+            if (dir != inum && bitmap_test(&m->reached, dir) && is_child_referenced_in_parent(m, dir, inum) > 0) {
+                keep = dir;
+            }
+        }
+    } else if (inum != ROOTINO) {
+        keep = m->namer[inum];
+    }
+
+    for (uint i = m->in_start[inum]; i < m->in_start[inum + 1]; i++) {
+        uint dir = m->in_src[i];
+        if (rep_dir_unlink(r, dir, inum, dir == keep) < 0) return -1;
+    }
+    if (keep) r->parent[inum] = keep;
+    return 0;
+}
+
+/*
+ * Marks what from reaches through the directories as the repairs have left
+ * them, and gives each directory reached a parent, the one it was first
+ * reached through, unless a fix has already chosen one. queue has room for
+ * every inode.
+ */
+void rep_walk(struct repair *r, uint from, uint *queue) {
+    struct fsck_model *m = r->m;
+    uint head = 0, tail = 0;
+
+    bitmap_set(&r->reached, from);
+    queue[tail++] = from;
+    while (head < tail) {
+        uint dir = queue[head++];
+        if (rep_inode(r, dir).type != T_DIR) continue;
+
+        uint blocks[MAXFILE];
+        rep_blocks(r, dir, blocks);
+        for (int k = 0; k < NDIRECT + NINDIRECT; k++) {
+            if (blocks[k] == 0 || blocks[k] >= m->sb->size) continue;
+
+            char buf[BSIZE];
+            const struct dirent *view = ws_view(&r->ws, blocks[k], buf);
+            for (uint i = 0; view && i < DPB; i++) {
+                uint x = view[i].inum;
+                if (x == 0 || x >= m->sb->ninodes || is_dot_or_dotdot(view[i].name) ||
+                    bitmap_test(&r->reached, x)) {
+                    continue;
+                }
+                struct dinode dip = rep_inode(r, x);
+                if (dip.type == 0) continue;
+
+                bitmap_set(&r->reached, x);
+                if (dip.type == T_DIR && !r->parent[x]) r->parent[x] = dir;
+                queue[tail++] = x;
+            }
+        }
+    }
+}
+
+/*
+ * Adopts an inode the root can't reach, then walks what it brings along.
+ * Returns 0 on success or -1 on error.
+ */
+int adopt_tree(struct repair *r, uint inum, uint *queue) {
+    if (adopt(r, inum) < 0) return -1;
+    if (r->lost_found) bitmap_set(&r->reached, r->lost_found);
+    if (rep_inode(r, inum).type != 0) rep_walk(r, inum, queue);
+    return 0;
+}
+
+/*
+ * Links back every inode the root can't reach once the fixes above are
+ * made, re-reading the directories as they left them rather than trusting
+ * the findings: a directory whose bad address was cleared names its
+ * entries again, and an inode named only in a cleared block is cut off.
+ * A cycle check_directory_cycles found is first unlinked from the
+ * directory it follows. Then only the tops of what is left are adopted,
+ * those no unreached directory names, so each cut-off subtree comes along
+ * whole; a freed directory's entries become the next tops, and if only a
+ * cycle is left its lowest inode is unlinked from it and adopted.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_unreachable(struct repair *r) {
+    struct fsck_model *m = r->m;
+    uint n = m->sb->ninodes;
+    struct bitmap inner;
+    uint *queue = malloc((size_t)n * sizeof(uint));
+    if (!queue || bitmap_alloc(&inner, n) < 0) {
+        perror("malloc");
+        free(queue);
+        return -1;
+    }
+    rep_walk(r, ROOTINO, queue);
+
+    int status = 0;
+    for (uint i = 0; i < m->findings.n && status == 0; i++) {
+        struct finding *f = &m->findings.list[i];
+        if (f->check != CHECK_DIR_CYCLE || bitmap_test(&r->reached, f->inum)) continue;
+        status = rep_dir_unlink(r, m->namer[f->inum], f->inum, 0);
+        if (status == 0) status = adopt_tree(r, f->inum, queue);
+    }
+
+    while (status == 0) {
+        // The unreached inodes that some unreached directory names
+        memset(inner.words, 0, (size_t)inner.nwords * sizeof(uint64));
+        uint left = 0, lowest = 0;
+        for (uint dir = 1; dir < n; dir++) {
+            if (bitmap_test(&r->reached, dir)) continue;
+            struct dinode dip = rep_inode(r, dir);
+            if (dip.type == 0) continue;
+            left++;
+            if (dip.type != T_DIR) continue;
+
+            uint blocks[MAXFILE];
+            rep_blocks(r, dir, blocks);
+            for (int k = 0; k < NDIRECT + NINDIRECT; k++) {
+                if (blocks[k] == 0 || blocks[k] >= m->sb->size) continue;
+                char buf[BSIZE];
+                const struct dirent *view = ws_view(&r->ws, blocks[k], buf);
+                for (uint j = 0; view && j < DPB; j++) {
+                    uint x = view[j].inum;
+                    if (x != 0 && x < n && x != dir && !is_dot_or_dotdot(view[j].name)) bitmap_set(&inner, x);
+                }
+            }
+        }
+        if (left == 0) break;
+
+        uint tops = 0;
+        for (uint inum = 1; inum < n && status == 0; inum++) {
+            if (bitmap_test(&r->reached, inum) || rep_inode(r, inum).type == 0) continue;
+            if (bitmap_test(&inner, inum)) {
+                if (!lowest) lowest = inum;
+                continue;
+            }
+            tops++;
+            status = adopt_tree(r, inum, queue);
+        }
+        if (status == 0 && tops == 0) {
+            for (uint dir = 1; dir < n && status == 0; dir++) {
+                if (!bitmap_test(&r->reached, dir) && rep_inode(r, dir).type == T_DIR) {
+                    status = rep_dir_unlink(r, dir, lowest, 0);
+                }
+            }
+            if (status == 0) status = adopt_tree(r, lowest, queue);
+        }
+    }
+    bitmap_free(&inner);
+    free(queue);
+    return status;
+}
+
+/*
+ * Rewrites a directory's "." and ".." to point at itself and parent, adding
+ * them if missing, and clears entries that name free inodes.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_directory(struct repair *r, uint dir, uint parent) {
+    struct fsck_model *m = r->m;
+    uint blocks[MAXFILE];
+    rep_blocks(r, dir, blocks);
+
+    int have_dot = 0, have_dotdot = 0;
+    for (int k = 0; k < NDIRECT + NINDIRECT; k++) {
+        if (blocks[k] == 0) continue;
+
+        char buf[BSIZE];
+        const struct dirent *view = ws_view(&r->ws, blocks[k], buf);
+        if (!view) continue;
+        for (uint i = 0; i < DPB; i++) {
+            uint want = view[i].inum;
+            if (want == 0) continue;
+
+            if (!have_dot && strncmp(view[i].name, ".", DIRSIZ) == 0) {
+                have_dot = 1;
+                want = dir;
+            } else if (!have_dotdot && strncmp(view[i].name, "..", DIRSIZ) == 0) {
+                have_dotdot = 1;
+                want = parent;
+            } else if (want < m->sb->ninodes && rep_inode(r, want).type == 0) {
+                want = 0;
+            }
+            if (want == view[i].inum) continue;
+
+            struct dirent *w = (struct dirent *)ws_block(&r->ws, blocks[k]);
+            if (!w) return -1;
+            w[i].inum = want;
+            view = w;
+            r->fixes++;
+        }
+    }
+
+    if (!have_dot) {
+        if (rep_dir_add(r, dir, ".", dir) < 0) return -1;
+        r->fixes++;
+    }
+    if (!have_dotdot) {
+        if (rep_dir_add(r, dir, "..", parent) < 0) return -1;
+        r->fixes++;
+    }
+    return 0;
+}
+
+/*
+ * Finds the directories whose "." or ".." is wrong, or that name free inodes,
+ * and fixes them. A directory's parent is the one fix_unreachable reached it
+ * through. One the scan couldn't read is rewritten whole, as clearing its
+ * bad addresses may have left it without "." or "..".
+ * Returns 0 on success or -1 on error.
+ */
+int fix_directories(struct repair *r) {
+    struct fsck_model *m = r->m;
+
+    for (uint dir = 1; dir < m->sb->ninodes; dir++) {
+        if (rep_inode(r, dir).type != T_DIR || !(m->itab.flags[dir] & INODE_DIR)) continue;
+
+        uint parent = dir == ROOTINO ? ROOTINO : r->parent[dir];
+        if (!parent) continue;  // freed
+
+        int broken = m->dir_count[dir] < 0 || !m->dir_format_ok[dir] || m->dotdot[dir] != (int)parent ||
+                     bitmap_test(&r->dots_gone, dir);
+        const struct dirent *entries = m->dir_ents[dir];
+        for (int k = 0; k < m->dir_count[dir] && !broken; k++) {
+            broken = entries[k].inum < m->sb->ninodes && !(m->itab.flags[entries[k].inum] & INODE_USED);
+        }
+        if (broken && fix_directory(r, dir, parent) < 0) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Gives every entry of a directory that repeats an earlier name a name of
+ * its own, "#inum" (or "#inum.k" if that is taken too). A repeated "." or
+ * "..", or a repeat naming the same inode, is cleared instead, since
+ * fix_directory has already settled the first one.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_duplicate_names(struct repair *r, uint dir) {
+    uint blocks[MAXFILE];
+    rep_blocks(r, dir, blocks);
+
+    // The names seen so far, copied, and a hash table of indexes into them
+    struct seen { char name[DIRSIZ]; uint inum; } *seen = NULL;
+    uint nseen = 0, cap = 0, tcap = 0;
+    int *slots = NULL, status = 0;
+
+    for (int k = 0; k < NDIRECT + NINDIRECT && status == 0; k++) {
+        if (blocks[k] == 0 || blocks[k] >= r->m->sb->size) continue;
+
+        char buf[BSIZE];
+        const struct dirent *view = ws_view(&r->ws, blocks[k], buf);
+        if (!view) continue;
+        for (uint i = 0; i < DPB && status == 0; i++) {
+            if (view[i].inum == 0) continue;
+
+            // Keep the table at most half full
+            if (2 * (nseen + 1) > tcap) {
+                tcap = tcap ? 2 * tcap : 64;
+                free(slots);
+                slots = malloc(tcap * sizeof(int));
+                if (!slots || grow_array((void **)&seen, &cap, tcap / 2, sizeof(*seen)) < 0) {
+                    perror("malloc");
+                    status = -1;
+                    break;
+                }
+                memset(slots, 0xff, tcap * sizeof(int));
+                for (uint s = 0; s < nseen; s++) {
+                    uint h = name_hash(seen[s].name) & (tcap - 1);
+                    while (slots[h] >= 0) h = (h + 1) & (tcap - 1);
+                    slots[h] = s;
+                }
+            }
+
+            char name[32] = { 0 };  // room for any "#inum.k"; only DIRSIZ bytes are kept
+            strncpy(name, view[i].name, DIRSIZ);
+            uint h = name_hash(name) & (tcap - 1);
+            while (slots[h] >= 0 && strncmp(seen[slots[h]].name, name, DIRSIZ) != 0) h = (h + 1) & (tcap - 1);
+            if (slots[h] >= 0) {
+                struct dirent *w = (struct dirent *)ws_block(&r->ws, blocks[k]);
+                if (!w) {
+                    status = -1;
+                    break;
+                }
+                view = w;
+                r->fixes++;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || seen[slots[h]].inum == w[i].inum) {
+                    w[i].inum = 0;
+                    continue;
+                }
+                for (uint n = 0; slots[h] >= 0; n++) {
+                    if (n) snprintf(name, sizeof(name), "#%u.%u", w[i].inum, n);
+                    else snprintf(name, sizeof(name), "#%u", w[i].inum);
+                    h = name_hash(name) & (tcap - 1);
+                    while (slots[h] >= 0 && strncmp(seen[slots[h]].name, name, DIRSIZ) != 0) h = (h + 1) & (tcap - 1);
+                }
+                // Only DIRSIZ bytes are kept, with no terminator when full
+                size_t len = strlen(name);
+                memset(w[i].name, 0, DIRSIZ);
+                memcpy(w[i].name, name, len < DIRSIZ ? len : DIRSIZ);
+            }
+            memcpy(seen[nseen].name, name, DIRSIZ);
+            seen[nseen].inum = view[i].inum;
+            slots[h] = nseen++;
+        }
+    }
+    free(slots);
+    free(seen);
+    return status;
+}
+
+/*
+ * Clears an inode's addresses past its size, from block ceil(size / BSIZE)
+ * on, and drops its indirect block if that starts past the size too. The
+ * size is left as it is. xv6 never read a directory's entries past its
+ * size, so fix_unreachable links an inode named only there into
+ * lost+found, and fix_directories puts back a "." or ".." there.
+ * Returns 0 on success or -1 on error.
+ */
+int fix_past_eof(struct repair *r, uint inum) {
+    struct fsck_model *m = r->m;
+    struct dinode dip = rep_inode(r, inum);
+    uint64 end = ((uint64)dip.size + BSIZE - 1) / BSIZE;
+    uint blocks[MAXFILE];
+    rep_blocks(r, inum, blocks);
+
+    // A "." or ".." going with the cleared blocks
+    for (uint64 k = end; dip.type == T_DIR && k < MAXFILE; k++) {
+        char buf[BSIZE];
+        const struct dirent *view = blocks[k] && blocks[k] < m->sb->size ? ws_view(&r->ws, blocks[k], buf) : NULL;
+        for (uint i = 0; view && i < DPB; i++) {
+            if (view[i].inum != 0 && is_dot_or_dotdot(view[i].name)) bitmap_set(&r->dots_gone, inum);
         }
+    }
 
-        uint *addrs = (uint *)indirect_block;
-        for (int i = 0; i < NINDIRECT; i++) {
-                if(addrs[i] != 0){
-                    if(!is_valid_block(sb, addrs[i])){
-                    printf("ERROR: bad address in inode\n");
-                    return -1;}
-                //Check data blocks allocation
-                allocated = is_block_allocated(sb, addrs[i]);
-                if(allocated < 0){
-                    printf("ERROR: failed to read bitmap\n");
-                    return -1;
-                }
-                if (!allocated) {
-                    printf("ERROR: address used by inode but marked free in bitmap\n");
-                    return -1;
-                }
-            }
+    int status = 0;
+    for (uint64 k = end; k < MAXFILE && status == 0; k++) {
+        if (blocks[k] == 0 || (k >= NDIRECT && end <= NDIRECT)) continue;
+        if (k < NDIRECT) {
+            struct dinode *w = rep_inode_w(r, inum);
+            if (!w) status = -1;
+            else w->addrs[k] = 0;
+        } else {
+            uint *w = (uint *)ws_block(&r->ws, dip.addrs[NDIRECT]);
+            if (!w) status = -1;
+            else w[k - NDIRECT] = 0;
         }
+        r->fixes++;
     }
-    return 0;
+    if (status == 0 && end <= NDIRECT && dip.addrs[NDIRECT]) {
+        struct dinode *w = rep_inode_w(r, inum);
+        if (!w) status = -1;
+        else w->addrs[NDIRECT] = 0;
+        r->fixes++;
+    }
+    return status;
 }
-    
 
 /*
- * Check all inodes in filesystem
+ * Recounts the links to every inode from the directories as the repairs
+ * have left them, and sets nlink to match.
+ * Returns 0 on success or -1 on error.
  */
-int check_all_inodes(struct superblock *sb) {
-    struct dinode dip;
-    
-    for (uint inum = 1; inum <= sb->ninodes; inum++) {
-        if (read_inode(sb, inum, &dip) < 0) {
-            return -1;
+int fix_link_counts(struct repair *r) {
+    struct fsck_model *m = r->m;
+    uint n = m->sb->ninodes;
+    uint *links = calloc(n, sizeof(uint));
+    if (!links) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (uint dir = 1; dir < n; dir++) {
+        if (rep_inode(r, dir).type != T_DIR) continue;
+
+        uint blocks[MAXFILE];
+        rep_blocks(r, dir, blocks);
+        for (int k = 0; k < NDIRECT + NINDIRECT; k++) {
+            if (blocks[k] == 0 || blocks[k] >= m->sb->size) continue;
+            char buf[BSIZE];
+            const struct dirent *view = ws_view(&r->ws, blocks[k], buf);
+            for (uint i = 0; view && i < DPB; i++) {
+                if (view[i].inum != 0 && view[i].inum < n && strncmp(view[i].name, ".", DIRSIZ) != 0) {
+                    links[view[i].inum]++;
+                }
+            }
         }
-        
-        if (dip.type == 0) continue;  // Skip free inodes
-        
-        if (check_inode_blocks(sb, &dip) < 0) {
-            return -1;
+    }
+
+    int status = 0;
+    for (uint inum = 1; inum < n && status == 0; inum++) {
+        struct dinode dip = rep_inode(r, inum);
+        if (dip.type == 0 || (uint)(ushort)dip.nlink == links[inum]) continue;
+
+        struct dinode *w = rep_inode_w(r, inum);
+        if (!w) {
+            status = -1;
+            break;
         }
+        w->nlink = links[inum];
+        r->fixes++;
     }
-    return 0;
+    free(links);
+    return status;
 }
 
 /*
- * Returns 1 if the given inode represents a directory; 0 otherwise.
- * Doing this because we shouldn't run functions on inodes that aren't directories
+ * Marks the blocks an inode uses, as the repairs have left it.
  */
-int is_directory(struct dinode *dip) {
-    return dip->type == T_DIR;
+void mark_inode_blocks(struct repair *r, uint inum, struct bitmap *bm) {
+    struct dinode dip = rep_inode(r, inum);
+    uint size = r->m->sb->size;
+
+    for (int i = 0; i <= NDIRECT; i++) {
+        if (dip.addrs[i] && dip.addrs[i] < size) bitmap_set(bm, dip.addrs[i]);
+    }
+    char buf[BSIZE];
+    const uint *ind = rep_indirect(r, inum, buf);
+    for (int i = 0; ind && i < NINDIRECT; i++) {
+        if (ind[i] && ind[i] < size) bitmap_set(bm, ind[i]);
+    }
 }
 
 /*
- * Reads a block containing directory entries into the given dirent array.
- * Returns number of valid dirents found in the block.
+ * Writes want over the on-disk bitmap a word at a time. Bit 0 and the bits
+ * past the end of the image keep their on-disk value, and only bitmap blocks
+ * that change go into the write set. With verbose, prints how many bits each
+ * changed block sets and clears; *flipped counts them all.
+ * Returns the number of bitmap blocks changed or -1 on error.
  */
-int read_dirent_block(uint blockno, struct dirent *entries, int max_entries) {
-    char block_data[BSIZE];  // Holds one disk block's worth of data
-    if (rblock(blockno, block_data) < 0) return -1; // Failed to read the block
+long store_bitmap(struct fsck_model *m, struct block_table *ws, struct bitmap *want,
+                  int verbose, unsigned long *flipped) {
+    struct superblock *sb = m->sb;
+    uint nbitmap = (sb->size + BPB - 1) / BPB;
+    const uint wpb = BSIZE / sizeof(uint64);
+    long changed = 0;
+
+    for (uint i = 0; i < nbitmap; i++) {
+        uint64 buf[BSIZE / sizeof(uint64)];
+        const uint64 *disk = ws_view(ws, sb->bmapstart + i, buf);
+        if (!disk) return -1;
+
+        uint64 *w = want->words + (size_t)i * wpb;
+        uint set = 0, cleared = 0;
+        for (uint k = 0; k < wpb; k++) {
+            uint64 first = (uint64)i * BPB + (uint64)k * 64;
+            uint64 keep = first == 0 ? 1 : 0;
+            if (first >= sb->size) keep = ~(uint64)0;
+            else if (first + 64 > sb->size) keep |= ~(uint64)0 << (sb->size - first);
 
-    struct dirent *dir_entries = (struct dirent *)block_data;
-    int n = BSIZE / sizeof(struct dirent);
-    int count = 0;
-    for (int i = 0; i < n && count < max_entries; i++) {
-        if (dir_entries[i].inum != 0) { //if valid directory entry
-            entries[count++] = dir_entries[i];
+            w[k] = (w[k] & ~keep) | (disk[k] & keep);
+            set += __builtin_popcountll(w[k] & ~disk[k]);
+            cleared += __builtin_popcountll(disk[k] & ~w[k]);
         }
+        if (set + cleared == 0) continue;
+
+        if (verbose) {
+            printf("BITMAP: block %u: %u bits set, %u cleared\n", sb->bmapstart + i, set, cleared);
+        }
+        char *p = ws_block(ws, sb->bmapstart + i);
+        if (!p) return -1;
+        memcpy(p, w, BSIZE);
+        *flipped += set + cleared;
+        changed++;
     }
-    return count; // Return number of valid entries
+    return changed;
 }
 
 /*
- * Reads all valid directory entries for the given inode.
- * Returns the number of entries read or -1 on error.
+ * Rewrites the free bitmap from the blocks the repaired inodes and the
+ * metadata use.
+ * Returns 0 on success or -1 on error.
  */
-int read_all_dirents(struct superblock *sb, struct dinode *dip, struct dirent *entries, int max_entries) {
-    int total = 0;
+int rebuild_bitmap(struct repair *r, int verbose) {
+    struct fsck_model *m = r->m;
+    struct superblock *sb = m->sb;
+    struct bitmap bm;
+    if (bitmap_alloc(&bm, sb->size) < 0) return -1;
 
-    // Direct blocks
-    for (int i = 0; i < NDIRECT && total < max_entries; i++) {
-        if (dip->addrs[i] == 0) continue; //skipping unused
+    // What count_metadata_refs counts
+    uint meta_end = sb->bmapstart + (sb->size + BPB - 1) / BPB;
+    for (uint b = 1; b < meta_end && b < sb->size; b++) {
+        if (b < 2 || (b >= sb->logstart && b < sb->logstart + sb->nlog) ||
+            (b >= sb->inodestart && b < sb->inodestart + (sb->ninodes + IPB - 1) / IPB) || b >= sb->bmapstart) {
+            bitmap_set(&bm, b);
+        }
+    }
 
-        int n = read_dirent_block(dip->addrs[i], &entries[total], max_entries - total);
-        if (n < 0) return -1;
-        total += n; //for each direct we are trying to accumulate the valid entries
+    for (uint inum = 1; inum < sb->ninodes; inum++) {
+        if (rep_inode(r, inum).type != 0) mark_inode_blocks(r, inum, &bm);
     }
 
-    // Indirect block
-    if (dip->addrs[NDIRECT] != 0 && total < max_entries) {
-        uint indirect[NINDIRECT];
-        if (rblock(dip->addrs[NDIRECT], indirect) < 0) return -1;
+    unsigned long flipped = 0;
+    long changed = store_bitmap(m, &r->ws, &bm, verbose, &flipped);
+    bitmap_free(&bm);
+    if (changed < 0) return -1;
+    r->fixes += changed;
+    return 0;
+}
 
-        for (int i = 0; i < NINDIRECT && total < max_entries; i++) {
-            if (indirect[i] == 0) continue;
+/*
+ * --rebuild-bitmap: writes the bitmap straight from the reference map, which
+ * already holds every block the inodes and metadata use, so it costs no
+ * reads beyond the check itself. Nothing else is repaired.
+ * Returns the number of blocks written or -1 on error.
+ */
+long rebuild_bitmap_only(struct fsck_model *m, int verbose, unsigned long *flipped) {
+    // The map is incomplete; check_all_inodes has already reported why
+    if (m->block_refs_bad) return -1;
 
-            int n = read_dirent_block(indirect[i], &entries[total], max_entries - total);
-            if (n < 0) return -1;
-            total += n;
-        }
-    }
+    struct bitmap want;
+    if (bitmap_alloc(&want, m->sb->size) < 0) return -1;
+    memcpy(want.words, m->block_used.words, (size_t)m->block_used.nwords * sizeof(uint64));
 
-    return total; // Returning num of valid dirents collected
+    struct block_table ws;
+    memset(&ws, 0, sizeof(ws));
+    long status = store_bitmap(m, &ws, &want, verbose, flipped);
+    if (status >= 0) status = ws_flush(&ws);
+    btab_free(&ws);
+    bitmap_free(&want);
+    return status;
 }
 
 /*
- * Returns 0 if the directory contains valid "." and ".." entries, else -1.
- * "." must point to its own inode number.
- * ".." must exist 
+ * Repairs everything run_checks found (it must have run with report_all):
+ * shared blocks are copied, bad addresses and blocks past the size
+ * cleared, extra parents unlinked, whatever the root then can't reach
+ * (cut-off cycles broken first) moved to lost+found, "." and ".."
+ * rewritten, entries naming free inodes cleared, and the bitmap rebuilt
+ * from what is left. Then the changed blocks are written back. With
+ * verbose, the bitmap changes are printed.
+ * Returns the number of blocks written or -1 on error.
  */
-int check_dot_and_dotdot(struct dirent *entries, int count, uint self_inum) {
-    int found_dot = 0, found_dotdot = 0;
+long repair(struct fsck_model *m, int verbose, uint *fixes) {
+    struct repair r;
+    memset(&r, 0, sizeof(r));
+    r.m = m;
+    r.parent = calloc(m->sb->ninodes + 1, sizeof(uint));
+    if (!r.parent || bitmap_alloc(&r.used, m->sb->size) < 0) {
+        free(r.parent);
+        return -1;
+    }
+    if (bitmap_alloc(&r.dots_gone, m->sb->ninodes + 1) < 0 || bitmap_alloc(&r.reached, m->sb->ninodes + 1) < 0) {
+        bitmap_free(&r.dots_gone);
+        bitmap_free(&r.used);
+        free(r.parent);
+        return -1;
+    }
+    memcpy(r.used.words, m->block_used.words, (size_t)m->block_used.nwords * sizeof(uint64));
 
-    for (int i = 0; i < count; i++) {
-        if (strncmp(entries[i].name, ".", DIRSIZ) == 0) {
-            // "." must point to self
-            if (entries[i].inum != self_inum){
-                return -1;
-            }
-            found_dot = 1;
-        } else if (strncmp(entries[i].name, "..", DIRSIZ) == 0) { //checking if ".." exists
-            found_dotdot = 1;
+    // Shared blocks are split first, so that clearing the bad entries of an
+    // indirect block never writes through one another inode also uses
+    long status = 0;
+    int shared = 0;
+    uint last = 0;
+    for (uint i = 0; i < m->findings.n; i++) shared |= m->findings.list[i].check == CHECK_MULTIPLY_USED;
+    if (shared) status = fix_shared_blocks(&r);
+    for (uint i = 0; i < m->findings.n && status == 0; i++) {
+        struct finding *f = &m->findings.list[i];
+        if (f->check == CHECK_BAD_ADDRESS && f->inum != last) {
+            status = fix_bad_addresses(&r, last = f->inum);
         }
     }
+    for (uint i = 0; i < m->findings.n && status == 0; i++) {
+        struct finding *f = &m->findings.list[i];
+        if (f->check == CHECK_SIZE_MISMATCH) status = fix_past_eof(&r, f->inum);
+    }
 
-    if (found_dot && found_dotdot) {
-        return 0;
+    // A directory keeps one parent; what the root then can't reach, cut-off
+    // cycles included, goes to lost+found
+    for (uint i = 0; i < m->findings.n && status == 0; i++) {
+        struct finding *f = &m->findings.list[i];
+        if (f->check == CHECK_MULTIPLE_PARENTS) status = fix_multiple_parents(&r, f->inum);
     }
-    return -1; // Missing one or both
-    
+    if (status == 0) status = fix_unreachable(&r);
+    if (status == 0) status = fix_directories(&r);
+
+    // Then the names and link counts the fixes above may also have changed
+    int relink = 0;
+    last = 0;
+    for (uint i = 0; i < m->findings.n && status == 0; i++) {
+        struct finding *f = &m->findings.list[i];
+        if (f->check == CHECK_DUPLICATE_NAME && f->inum != last) {
+            status = fix_duplicate_names(&r, last = f->inum);
+        }
+        relink |= f->check != CHECK_MARKED_FREE && f->check != CHECK_BITMAP_UNUSED;
+    }
+    if (status == 0 && relink) status = fix_link_counts(&r);
+    if (status == 0) status = rebuild_bitmap(&r, verbose);
+    if (status == 0) status = ws_flush(&r.ws);
+
+    *fixes = r.fixes;
+    btab_free(&r.ws);
+    bitmap_free(&r.used);
+    bitmap_free(&r.dots_gone);
+    bitmap_free(&r.reached);
+    free(r.parent);
+    return status;
 }
 
 /*
- * Iterates through all in-use inodes.
- * For each directory, ensures it contains a "." entry pointing to itself
- * and a ".." entry (but not checking parent validation here).
- * Returns 0 on successs or prints error and returns -1 on failure.
+ * Fingerprint cache (--cache FILE). After a run the metadata the check read
+ * is hashed per 64 KiB region of the image and saved with the superblock:
+ * the inode table and bitmap by their own regions, and the indirect and
+ * directory blocks grouped by the region they fall in. With it goes what
+ * the scan derived from the indirect and directory blocks (struct
+ * prior_state). The next run hashes the same regions first. If none changed
+ * and the last run was clean, the image is still clean and the model is
+ * never built. Otherwise only the inodes with a block in a changed region
+ * are read and decoded again; the checks then run over the whole model,
+ * since they look at the reference counts of the whole image.
  */
-int check_all_directory_formats(struct superblock *sb) {
-    struct dinode dip;
-    // Max number of entries we can store
-    struct dirent entries[MAX_DIRENT_COUNT];
+#define FP_MAGIC "chkfsfp2"
 
-    for (uint inum = 1; inum < sb->ninodes; inum++) {
-        if (read_inode(sb, inum, &dip) < 0){
-            return -1; // Failed to read inode
-        }
-        if (dip.type == 0 || !is_directory(&dip)){
-            continue; // Skipoing unused or non-directory inodes
-        }
+enum { FP_SUPERBLOCK, FP_INODES, FP_BITMAP, FP_BLOCKS };
 
-        int count = read_all_dirents(sb, &dip, entries, MAX_DIRENT_COUNT);
-        if (count < 0) {
-            printf("ERROR: failed to read directory entries\n");
-            return -1;
-        }
+struct fp_region {
+    uint kind;
+    uint region;            // first block / FP_REGION_BLOCKS
+    uint64 hash;
+};
 
-        // Checking "." and ".." for each
-        if (check_dot_and_dotdot(entries, count, inum) < 0) {
-            printf("ERROR: directory not properly formatted\n");
-            return -1;
+struct fp_header {
+    char magic[8];
+    uint nregions;
+    uint clean;             // 1 if the run that saved it found nothing
+    struct superblock sb;
+    uint ninodes;           // inodes with derived state: sb.ninodes + 1
+    uint nind;              // indirect blocks saved
+    uint ndirents;          // directory entries saved
+    uint pad;
+};
+
+struct fingerprint {
+    struct fp_region *regions;
+    uint n, cap;
+    uint changed;           // regions that differ from the cache, or are new
+};
+
+/*
+ * xxHash64, four independent lanes over each 32 bytes.
+ */
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64 rotl64(uint64 x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64 xxh_round(uint64 acc, uint64 in) {
+    return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64 xxh_merge(uint64 h, uint64 v) {
+    return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static inline uint64 read64(const unsigned char *p) {
+    uint64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64 xxh64(const void *data, size_t len, uint64 seed) {
+    const unsigned char *p = data, *end = p + len;
+    uint64 h;
+
+    if (len >= 32) {
+        uint64 v[4] = { seed + XXH_P1 + XXH_P2, seed + XXH_P2, seed, seed - XXH_P1 };
+        for (; p + 32 <= end; p += 32) {
+            for (int i = 0; i < 4; i++) {
+                v[i] = xxh_round(v[i], read64(p + 8 * i));
+            }
+        }
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh_merge(h, v[i]);
         }
+    } else {
+        h = seed + XXH_P5;
     }
+    h += len;
 
-    return 0;
+    for (; p + 8 <= end; p += 8) {
+        h = rotl64(h ^ xxh_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        uint32 w;
+        memcpy(&w, p, sizeof(w));
+        h = rotl64(h ^ (uint64)w * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
 }
 
 /*
- * Searches for ".." entry in a list of directory entries and returns the inode it points to.
- * Returns the inode number or -1 if ".." entry is not found.
+ * Hashes blocks, in order, into one value per region of the given kind.
+ * Each block's hash is seeded with its number, so moving a block counts
+ * as a change. Returns 0 on success or -1 if a block can't be read.
  */
-int get_dotdot_inum(struct dirent *entries, int count) {
-    for (int i = 0; i < count; i++) {
-        if (strncmp(entries[i].name, "..", DIRSIZ) == 0) {
-            return entries[i].inum;  // Found "..", the supposed parent, and we should return its inum
+int fp_hash_blocks(struct fingerprint *fp, uint kind, const uint *blocks, uint n) {
+    char buf[BSIZE];
+    uint i = 0;
+    while (i < n) {
+        uint region = blocks[i] / FP_REGION_BLOCKS;
+        uint64 sums[FP_REGION_BLOCKS];
+        uint k = 0;
+        for (; i < n && blocks[i] / FP_REGION_BLOCKS == region; i++) {
+            const void *p = bview(blocks[i], buf);
+            if (!p) return -1;
+            sums[k++] = xxh64(p, BSIZE, blocks[i]);
         }
+        if (grow_array((void **)&fp->regions, &fp->cap, fp->n + 1, sizeof(struct fp_region)) < 0) return -1;
+        fp->regions[fp->n++] = (struct fp_region){ kind, region, xxh64(sums, k * sizeof(uint64), region) };
     }
-    return -1;  // ".." not found
+    return 0;
 }
 
 /*
- * Checks whether the given parent inode contains a directory entry that refers to the specified child inode.
- * Returns 1 if the parent directory contains a reference to the given child inode.
- * Returns 0 if not found or -1 on error.
+ * Fetches a batch of blocks, where batch_read can, and hashes them without
+ * repeats. Blocks the fetch keeps are there for build_model to use too.
+ * Returns 0 on success or -1 on error.
  */
-int is_child_referenced_in_parent(struct superblock *sb, uint parent_inum, uint child_inum) {
-    struct dinode parent_dip;
-    struct dirent parent_entries[MAX_DIRENT_COUNT];
-
-    if (read_inode(sb, parent_inum, &parent_dip) < 0)
-        return -1; // Could not read the inode so error
-
-    if (!is_directory(&parent_dip))
-        return -1;  // Making sure that parent must be a directory
+int fp_hash_batch(struct fingerprint *fp, uint kind, struct read_batch *b) {
+    if (batch_depth && !img.stream) batch_read(b, batch_depth, keep_fetched, NULL);
+    qsort(b->blocks, b->n, sizeof(uint), cmp_uint);
 
-    int count = read_all_dirents(sb, &parent_dip, parent_entries, MAX_DIRENT_COUNT);
-    // Load all directory entries from the parent's data blocks
-
-    if (count < 0){
-        return -1;
+    uint k = 0;
+    for (uint i = 0; i < b->n; i++) {
+        if (k == 0 || b->blocks[i] != b->blocks[k - 1]) b->blocks[k++] = b->blocks[i];
     }
+    return fp_hash_blocks(fp, kind, b->blocks, k);
+}
 
-    // Looking through the directory entries to find one that points to the child
-    for (int i = 0; i < count; i++) {
-        if (parent_entries[i].inum == child_inum) {
-            return 1;  // Found child in parent
-        }
+/*
+ * Hashes a contiguous range of blocks. Returns 0 on success or -1 on error.
+ */
+int fp_hash_range(struct fingerprint *fp, uint kind, uint start, uint nblocks) {
+    struct read_batch b = { 0 };
+    int status = 0;
+    for (uint i = 0; i < nblocks && status == 0; i++) {
+        status = batch_add(&b, start + i);
     }
-
-    return 0;  // Not found
+    if (status == 0) status = fp_hash_batch(fp, kind, &b);
+    batch_free(&b);
+    return status;
 }
 
 /*
- * Verifies that each directory's ".." entry points to the correct parent inode and that parent directory also references that child.
- * Returns 0 if all relationships are valid and -1 if there happens to be an error.
+ * Fingerprints everything a check reads: the superblock, the inode table, the
+ * bitmap, and every indirect block and directory block the inodes name.
+ * Returns 0 on success or -1 if something could not be read.
  */
-int check_parent_directory_mismatch(struct superblock *sb) {
-    struct dinode dip;
-    struct dirent entries[MAX_DIRENT_COUNT];
+int fingerprint_image(struct superblock *sb, struct fingerprint *fp) {
+    uint n = sb->ninodes + 1;
+    uint inode_blocks = (n + IPB - 1) / IPB;
+    uint nbitmap = (sb->size + BPB - 1) / BPB;
 
-    // For all inodes in the filesystem
-    for (uint inum = 1; inum < sb->ninodes; inum++) {
-        if (read_inode(sb, inum, &dip) < 0){
+    if (fp_hash_range(fp, FP_SUPERBLOCK, SUPERBLOCK, 1) < 0 ||
+        fp_hash_range(fp, FP_INODES, sb->inodestart, inode_blocks) < 0 ||
+        fp_hash_range(fp, FP_BITMAP, sb->bmapstart, nbitmap) < 0) {
         return -1;
-        }
-
-        // Skip unused inodes or non-directory inodes
-        if (dip.type == 0 || !is_directory(&dip)) {
-            continue;
-        }
-        
-        // Load all directory entries for this current directory inode of the for loop
-        int count = read_all_dirents(sb, &dip, entries, MAX_DIRENT_COUNT);
-        if (count < 0) {
-            printf("ERROR: failed to read directory entries\n");
-            return -1;
-        }
+    }
 
-        // Root inode always has itself as ".."
-        if (inum == ROOTINO){
-            continue;
+    // Every indirect block and the directories' direct blocks, then what the
+    // directories' indirect blocks name once those have been fetched
+    struct read_batch blocks = { 0 }, dirind = { 0 };
+    char buf[BSIZE];
+    int status = 0;
+    for (uint blk = 0; blk < inode_blocks && status == 0; blk++) {
+        const struct dinode *ip = bview(sb->inodestart + blk, buf);
+        if (!ip) {
+            status = -1;
+            break;
         }
+        for (uint k = 0; k < IPB && blk * IPB + k < n && status == 0; k++) {
+            const struct dinode *dip = &ip[k];
+            uint ind = dip->addrs[NDIRECT];
+            if (dip->type == 0) continue;
 
-        // Getting the ".." inode number of the the directory's supposed parent we are checking
-        int parent_inum = get_dotdot_inum(entries, count);
-        if (parent_inum <= 0 || parent_inum >= sb->ninodes) {
-            printf("ERROR: parent directory mismatch\n");
-            return -1;
+            if (ind && ind < sb->size) status = batch_add(&blocks, ind);
+            if (dip->type != T_DIR || blk * IPB + k >= sb->ninodes) continue;
+            for (int i = 0; i < NDIRECT && status == 0; i++) {
+                if (dip->addrs[i] && dip->addrs[i] < sb->size) status = batch_add(&blocks, dip->addrs[i]);
+            }
+            if (ind && ind < sb->size && status == 0) status = batch_add(&dirind, ind);
         }
-
-        // Then checking if the claimed parent contains a reference to this directory
-        int referenced = is_child_referenced_in_parent(sb, parent_inum, inum);
-        if (referenced < 0) {
-            printf("ERROR: parent directory mismatch\n");
-            return -1;
-        } else if (referenced == 0) {
-            printf("ERROR: parent directory mismatch\n");
-            return -1;
+    }
+    if (status == 0 && batch_depth && !img.stream) batch_read(&dirind, batch_depth, keep_fetched, NULL);
+    for (uint j = 0; j < dirind.n && status == 0; j++) {
+        const uint *addrs = bview(dirind.blocks[j], buf);
+        for (int i = 0; addrs && i < NINDIRECT && status == 0; i++) {
+            if (addrs[i] && addrs[i] < sb->size) status = batch_add(&blocks, addrs[i]);
         }
     }
+    if (status == 0) status = fp_hash_batch(fp, FP_BLOCKS, &blocks);
+    batch_free(&blocks);
+    batch_free(&dirind);
+    return status;
+}
 
-    return 0; //if directories all pass
+int cmp_region(const void *a, const void *b) {
+    const struct fp_region *x = a, *y = b;
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    return x->region < y->region ? -1 : x->region > y->region;
+}
+
+void prior_free(struct prior_state *p) {
+    free(p->indirect);
+    free(p->dir_ents);
+    free(p->data);
+    bitmap_free(&p->dirty);
+    memset(p, 0, sizeof(*p));
 }
 
 /*
- * Allocates and builds a map of all inodes referenced in directory entries.
- * Returns a pointer to the map. This will be a NULL on error.\
- * Referenced[i] == 1 if inode i is used in a dir
- * Caller is responsible for freeing the returned array.
+ * Reads the derived state that follows the regions in a cache file into p:
+ * the per-inode counts, "..", and format, then the indirect entries and the
+ * dirents, each in inode order. Leaves p->n at 0 if the file is short or
+ * doesn't add up.
  */
-int *build_inode_reference_map(struct superblock *sb) {
-    int *referenced = malloc(sb->ninodes * sizeof(int));
-    if (!referenced) {
-        perror("malloc");
-        return NULL;
-    }
+void fp_load_prior(FILE *f, const struct fp_header *h, struct prior_state *p) {
+    uint n = h->ninodes;
+    size_t counts = 3 * (size_t)n * sizeof(int) + ((n + 3) & ~3u);
+    size_t bytes = counts + (size_t)h->nind * BSIZE + (size_t)h->ndirents * sizeof(struct dirent);
 
-    // Setting them all to 0
-    for (uint i = 0; i < sb->ninodes; i++) {
-        referenced[i] = 0;
+    char *data = malloc(bytes);
+    p->indirect = calloc(n, sizeof(uint *));
+    p->dir_ents = calloc(n, sizeof(struct dirent *));
+    if (!data || !p->indirect || !p->dir_ents || fread(data, 1, bytes, f) != bytes) {
+        free(data);
+        free(p->indirect);
+        free(p->dir_ents);
+        p->indirect = NULL;
+        p->dir_ents = NULL;
+        return;
     }
+    count_io(bytes, 1);
 
-    struct dinode dip;
-    struct dirent entries[MAX_DIRENT_COUNT];
-
-    // Iterate through all inodes
-    for (uint dir_inum = 1; dir_inum < sb->ninodes; dir_inum++) {
-        if (read_inode(sb, dir_inum, &dip) < 0) {
-            free(referenced);
-            return NULL;
+    p->data = data;
+    p->ind_count = (int *)data;
+    p->dir_count = p->ind_count + n;
+    p->dotdot = p->dir_count + n;
+    p->dir_format_ok = (char *)(p->dotdot + n);
+    const uint *ind = (const uint *)(data + counts);
+    const struct dirent *ents = (const struct dirent *)(ind + (size_t)h->nind * NINDIRECT);
+    uint nind = 0, ndirents = 0;
+    for (uint inum = 0; inum < n; inum++) {
+        if (p->ind_count[inum] == NINDIRECT && nind < h->nind) {
+            p->indirect[inum] = ind + (size_t)nind++ * NINDIRECT;
         }
-
-        // Skipping unused or non-directory inodes
-        if (dip.type == 0 || !is_directory(&dip))
-            continue;
-
-        // We here are reading all valid dirents from this specific directory
-        int count = read_all_dirents(sb, &dip, entries, MAX_DIRENT_COUNT);
-        if (count < 0) {
-            printf("ERROR: failed to read directory entries\n");
-            free(referenced);
-            return NULL;
+        if (p->dir_count[inum] > 0 && (uint)p->dir_count[inum] <= h->ndirents - ndirents) {
+            p->dir_ents[inum] = ents + ndirents;
+            ndirents += p->dir_count[inum];
         }
+    }
+    p->n = nind == h->nind && ndirents == h->ndirents ? n : 0;
+}
 
-        // For each dirent we mark the referred inode as referenced
-        for (int i = 0; i < count; i++) {
-            uint ref_inum = entries[i].inum;
-            if (ref_inum > 0 && ref_inum < sb->ninodes) {
-                referenced[ref_inum] = 1;
+/*
+ * Compares fp with the cache file, counting the regions that changed and
+ * marking them in prior->dirty. Unless the image is unchanged since a clean
+ * run, also loads the derived state into prior; prior->n stays 0 if the
+ * file doesn't hold one for this superblock.
+ * Returns 1 if the cache holds exactly this fingerprint of a clean image, else 0.
+ */
+int fp_load(const char *path, struct superblock *sb, struct fingerprint *fp, struct prior_state *p) {
+    fp->changed = fp->n;
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+
+    struct fp_header h;
+    struct fp_region *old = NULL;
+    int match = 0;
+    if (fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, FP_MAGIC, 8) == 0 &&
+        memcmp(&h.sb, sb, sizeof(*sb)) == 0 && h.ninodes == sb->ninodes + 1 &&
+        (old = malloc((h.nregions + 1) * sizeof(*old))) &&
+        fread(old, sizeof(*old), h.nregions, f) == h.nregions &&
+        bitmap_alloc(&p->dirty, sb->size / FP_REGION_BLOCKS + 1) == 0) {
+        // Both lists are in (kind, region) order
+        uint i = 0, j = 0;
+        fp->changed = 0;
+        while (i < fp->n) {
+            int c = j < h.nregions ? cmp_region(&fp->regions[i], &old[j]) : -1;
+            if (c > 0) {
+                j++;
+                continue;
+            }
+            if (c < 0 || fp->regions[i].hash != old[j].hash) {
+                fp->changed++;
+                if (fp->regions[i].kind == FP_INODES || fp->regions[i].kind == FP_BLOCKS) {
+                    bitmap_set(&p->dirty, fp->regions[i].region);
+                }
             }
+            i++;
+            if (c == 0) j++;
         }
+        match = h.clean && fp->changed == 0 && fp->n == h.nregions;
+        if (!match) fp_load_prior(f, &h, p);
     }
-
-    return referenced;
+    count_io(0, 1);
+    free(old);
+    fclose(f);
+    return match;
 }
 
 /*
-* Builds a map tracking which blocks are referenced by inodes 
-* returns a pointer to map or NULL on error
-* Caller must free the returned array 
-*/
-int *build_block_reference_map(struct superblock *sb){
-    int *referenced = malloc(sb->size * sizeof(int));
-    if(!referenced){
-        perror("malloc");
-        return NULL;
+ * Saves fp, and what the model derived, as the fingerprint of the image,
+ * replacing the file whole. clean says whether the checks found nothing.
+ * Returns 0 on success or -1 on error.
+ */
+int fp_save(const char *path, struct superblock *sb, struct fingerprint *fp, struct fsck_model *m, int clean) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        perror(tmp);
+        return -1;
     }
 
-    // Initialize all entries to 0
-    for(uint i = 0; i < sb->size; i++){
-        referenced[i] = 0;
+    uint n = sb->ninodes + 1;
+    struct fp_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FP_MAGIC, 8);
+    h.nregions = fp->n;
+    h.clean = clean;
+    h.sb = *sb;
+    h.ninodes = n;
+    for (uint inum = 0; inum < n; inum++) {
+        h.nind += m->ind_count[inum] == NINDIRECT;
+        h.ndirents += m->dir_count[inum] > 0 ? m->dir_count[inum] : 0;
     }
 
-    // Mark essential system blocks as referenced:
-    
-    // 1. Superblock (block 1)
-    referenced[1] = 1;
-    
-    // 2. Log blocks (from logstart to logstart + nlog)
-    for(uint b = sb->logstart; b < sb->logstart + sb->nlog; b++){
-        if(b < sb->size) referenced[b] ++;
+    static const char zero[4];
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(fp->regions, sizeof(struct fp_region), fp->n, f) == fp->n &&
+             fwrite(m->ind_count, sizeof(int), n, f) == n &&
+             fwrite(m->dir_count, sizeof(int), n, f) == n &&
+             fwrite(m->dotdot, sizeof(int), n, f) == n &&
+             fwrite(m->dir_format_ok, 1, n, f) == n &&
+             fwrite(zero, 1, -n & 3, f) == (-n & 3);
+    for (uint inum = 0; inum < n && ok; inum++) {
+        if (m->ind_count[inum] == NINDIRECT) {
+            ok = fwrite(m->indirect[inum], sizeof(uint), NINDIRECT, f) == NINDIRECT;
+        }
     }
-    
-    // 3. Bitmap blocks (from bmapstart to inodestart-1)
-    uint bitmap_blocks = (sb->size + BSIZE*8 - 1) / (BSIZE*8);
-    for(uint b = sb->bmapstart; b < sb->bmapstart + bitmap_blocks && b < sb->size; b++){
-        referenced[b] ++;
+    for (uint inum = 0; inum < n && ok; inum++) {
+        if (m->dir_count[inum] > 0) {
+            ok = fwrite(m->dir_ents[inum], sizeof(struct dirent), m->dir_count[inum], f) ==
+                 (size_t)m->dir_count[inum];
+        }
     }
-
-    // 4. Inode blocks (from inodestart to bmapstart-1)
-    uint inode_blocks = (sb->ninodes + IPB - 1) / IPB;
-    for(uint b = sb->inodestart; b < sb->inodestart + inode_blocks && b < sb->size; b++){
-        referenced[b] ++;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
     }
+    return 0;
+}
 
-    // Now scan all inodes for their data block references
-    struct dinode dip;
-    for(uint inum = 1; inum < sb->ninodes; inum++){
-        if(read_inode(sb, inum, &dip) < 0){
-            free(referenced);
-            return NULL;
-        }
-
-        if(dip.type == 0) continue; // Skip free inodes
-
-        // Check direct blocks
-        for(int i = 0; i < NDIRECT; i++){
-            if(dip.addrs[i] != 0){
-                if(dip.addrs[i] >= sb->size) {
-                    free(referenced);
-                    return NULL;
-                }
-                referenced[dip.addrs[i]] ++;
-            }
-        }
+void fp_free(struct fingerprint *fp) {
+    free(fp->regions);
+    memset(fp, 0, sizeof(*fp));
+}
 
-        // Check indirect block
-        if(dip.addrs[NDIRECT] != 0){
-            // Validate the indirect block number is within filesystem bounds
-            if(dip.addrs[NDIRECT] >= sb->size) {
-                free(referenced);
-                return NULL;
-            }
-            referenced[dip.addrs[NDIRECT]] ++;
-            
-            // Read the indirect block into memory
-            uint indirect[NINDIRECT];
-            if(rblock(dip.addrs[NDIRECT], indirect) < 0){
-                free(referenced);
-                return NULL;
-            }
+/*
+ * Output formats for the findings.
+ */
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_NDJSON };
 
-            // Traverse all entries in the indirect block
-            for(int i = 0; i < NINDIRECT; i++){
-                // Skip unused blocks (zero address)
-                if(indirect[i] != 0){
-                    // Validate the data block number is within filesystem bounds
-                    if(indirect[i] >= sb->size) {
-                        free(referenced);
-                        return NULL; // Error: Failed to read indirect block
-                    }
-                    referenced[indirect[i]] ++;
-                }
-            }
+/*
+ * Writes s as a JSON string. Bytes outside printable ASCII are escaped, so
+ * odd directory names can't break the record.
+ */
+void json_string(const char *s, size_t maxlen) {
+    putchar('"');
+    for (size_t i = 0; i < maxlen && s[i]; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
         }
     }
-    return referenced;
+    putchar('"');
 }
 
 /*
- * Verifies that each used inode is referenced by at least one directory entry which means that the type!=0
- * We are using build_inode_reference_map() helper function to determine which inodes are referred to
- * Returns 0 if all in-use inodes are found in directories or prints an error and returns -1.
+ * Writes one finding as a JSON object. Check numbers match the README.
  */
-int check_used_inode_found_in_directory(struct superblock *sb) {
-    // Getting the map of inodes that are referenced from helper
-    int *referenced = build_inode_reference_map(sb);
-    if (!referenced) return -1;
-
-    struct dinode dip;
-
-    // Going through inodes
-    for (uint inum = 1; inum < sb->ninodes; inum++) {
-        if (read_inode(sb, inum, &dip) < 0) {
-            free(referenced);
-            return -1;
-        }
+void json_finding(struct fsck_model *m, struct finding *f, int ndjson) {
+    printf("{%s\"check\":%d,\"inode\":%u,\"block\":%u,\"message\":",
+           ndjson ? "\"type\":\"finding\"," : "", f->check, f->inum, f->blockno);
+    json_string(f->msg, strlen(f->msg));
+    if (m && f->inum) {
+        char path[512];
+        inode_path(m, f->inum, path, sizeof(path));
+        printf(",\"path\":");
+        json_string(path, sizeof(path));
+    }
+    printf("}");
+}
 
-        // If its in use...
-        if (dip.type != 0 && !referenced[inum]) { // But not marked in the map...
-            printf("ERROR: inode marked used but not found in a directory\n"); // We print the corresponding error
-            free(referenced);
-            return -1;
-        }
+/*
+ * Writes the summary record: exit status, how many findings, and what the run cost.
+ */
+void json_summary(int status, uint nfindings, double wall, int ndjson) {
+    printf("{%s\"status\":%d,\"findings\":%u,\"wall_time\":%.6f,\"bytes_read\":%lu,\"syscalls\":%lu,\"fixes\":%u,\"bits_flipped\":%lu,\"blocks_written\":%ld,\"phases\":{",
+           ndjson ? "\"type\":\"summary\"," : "", status, nfindings, wall, stats.bytes_read, stats.syscalls,
+           stats.fixes, stats.bits_flipped, stats.blocks_written);
+    for (int i = 0; i < NPHASES; i++) {
+        printf("%s\"%s\":%.6f", i ? "," : "", phase_names[i], stats.phase[i]);
     }
+    printf("}}");
+}
 
-    free(referenced);
-    return 0;
+/*
+ * Writes every finding and the summary as one JSON document, or as one
+ * record per line (ndjson). m may be NULL if the model could not be built,
+ * in which case the findings carry no paths.
+ */
+void print_json(struct fsck_model *m, struct findings *found, int status, double wall, int ndjson) {
+    if (!ndjson) printf("{\"findings\":[");
+    for (uint i = 0; i < found->n; i++) {
+        if (!ndjson && i) printf(",");
+        json_finding(m, &found->list[i], ndjson);
+        if (ndjson) printf("\n");
+    }
+    if (!ndjson) printf("],\"summary\":");
+    json_summary(status, found->n, wall, ndjson);
+    printf("%s\n", ndjson ? "" : "}");
 }
 
 /*
- * Verify all blocks marked in-use in bitmap are actually referenced
- * Returns 0 if valid, -1 on error with message printed
- */
-int check_referenced_blocks(struct superblock *sb) {
-    // Generate a map tracking which blocks are referenced by inodes/metadata
-    int *referenced = build_block_reference_map(sb);
-    if (!referenced) return -1;
-
-     // Iterate through all blocks (skip block 0, reserved for boot)
-    for (uint blockno = 1; blockno < sb->size; blockno++) {
-        int allocated = is_block_allocated(sb, blockno);
-        if (allocated < 0) {
-            free(referenced);
-            return -1;
+ * Prints the findings: just the message when stopping at the first one,
+ * and with the check, inode, block and path of each in --all mode.
+ */
+void print_findings(struct fsck_model *m) {
+    for (uint i = 0; i < m->findings.n; i++) {
+        struct finding *f = &m->findings.list[i];
+        if (!m->report_all) {
+            printf("%s\n", f->msg);
+            continue;
         }
 
-        // Error if block is allocated in bitmap but not referenced anywhere
-        if (allocated && referenced[blockno] == 0) {
-            printf("ERROR: bitmap marks block in use but it is not in use\n");
-            free(referenced);
-            return -1;
+        printf("%s (check %d", f->msg, f->check);
+        if (f->inum) {
+            char path[512];
+            inode_path(m, f->inum, path, sizeof(path));
+            printf(", inode %u, path %s", f->inum, path);
         }
+        if (f->blockno) printf(", block %u", f->blockno);
+        printf(")\n");
     }
+}
+
 
-    free(referenced);
+static struct option long_options[] = {
+    { "no-mmap", no_argument, NULL, 'M' },
+    { "cache-blocks", required_argument, NULL, 'C' },
+    { "stats", no_argument, NULL, 'S' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "all", no_argument, NULL, 'a' },
+    { "format", required_argument, NULL, 'F' },
+    { "yes", no_argument, NULL, 'y' },
+    { "rebuild-bitmap", no_argument, NULL, 'B' },
+    { "io-depth", required_argument, NULL, 'D' },
+    { "mem-limit", required_argument, NULL, 'L' },
+    { "cache", required_argument, NULL, 'K' },
+    { "replay-log", no_argument, NULL, 'R' },
+    { "install-log", no_argument, NULL, 'I' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * Parses a byte count with an optional K, M or G suffix.
+ * Returns 0 on success or -1 if it isn't one.
+ */
+int parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s) return -1;
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; // fall through
+    case 'M': case 'm': n <<= 10; // fall through
+    case 'K': case 'k': n <<= 10; end++; break;
+    }
+    if (*end) return -1;
+    *out = n;
     return 0;
 }
 
 /*
- * Verify no block is referenced by more than one inode
- * Returns 0 if valid, -1 on error with message printed
+ * Reports an error that stopped the run before there was a model to check.
  */
-int check_multiply_referenced_blocks(struct superblock *sb) {
-    // Generate a map tracking how many times each block is referenced
-    int *referenced = build_block_reference_map(sb);
-    if (!referenced) return -1;
-
-    // Only check data blocks (after inode blocks)
-    uint start_block = sb->inodestart + ((sb->ninodes + IPB - 1) / IPB);
-    
-    // Scan all data blocks (from start_block to sb->size - 1)
-    for (uint blockno = start_block; blockno < sb->size; blockno++) {
-        if (referenced[blockno] > 1) {
-            printf("ERROR: address used more than once\n");
-            free(referenced);
-            return -1;
-        }
+int fail_early(int format, const char *msg, double start) {
+    if (format == FORMAT_TEXT) {
+        printf("%s\n", msg);
+    } else {
+        struct finding f = { CHECK_IO, 0, 0, msg };
+        struct findings found = { &f, 1, 1 };
+        print_json(NULL, &found, 1, now_seconds() - start, format == FORMAT_NDJSON);
     }
-    free(referenced);
-    return 0;
+    cache_free();
+    image_close();
+    return 1;
 }
 
 /*
- * Verifies that each inode referenced in any directory is actually marked in-use.
- * We get reference map from build_inode_reference_map() helper
- * Returns 0 if all dirent inodes are valid or prints an error and returns -1.
+ * Checks a repaired image again from the start, through a fresh open so
+ * that nothing mapped or cached before the write-back is seen.
+ * Returns 0 if it is clean, 1 if problems are left, or -1 on error.
  */
-int check_dirent_refers_to_allocated_inode(struct superblock *sb) {
-    // Get map
-    int *referenced = build_inode_reference_map(sb);
-    if (!referenced) return -1;
+int recheck(const char *path, struct superblock *sb, int use_mmap, uint cache_blocks, int nthreads) {
+    image_close();
+    cache_free();
+    if (image_open(path, use_mmap, 0) < 0) return -1;
+    if (!img.map && cache_init(cache_blocks) < 0) return -1;
 
-    struct dinode dip;
+    struct fsck_model m;
+    struct prior_state none;
+    memset(&m, 0, sizeof(m));
+    memset(&none, 0, sizeof(none));
+    if (build_model(sb, &m, nthreads, &none) < 0) return -1;
+    int status = run_checks(&m) < 0 ? 1 : 0;
+    free_model(&m);
+    return status;
+}
 
-    // Check all inodes that are referenced in directories
-    for (uint inum = 1; inum < sb->ninodes; inum++) {
-        // If this inode was referenced
-        if (referenced[inum]) {
-            if (read_inode(sb, inum, &dip) < 0) {
-                free(referenced);
-                return -1;
-            }
+int main(int argc, char *argv[]) {
+    int use_mmap = 1;
+    uint cache_blocks = CACHE_DEFAULT_BLOCKS;
+    int show_stats = 0;
+    int nthreads = 1;
+    int report_all = 0;
+    int fix = 0;
+    int rebuild = 0;
+    int format = FORMAT_TEXT;
+    int bad_usage = 0;
+    const char *cache_path = NULL;
+    int install = 0;
+    int opt;
 
-            // Here we make sure it's actually in use
-            if (dip.type == 0) {
-                printf("ERROR: inode referred to in directory but marked free\n");
-                free(referenced);
-                return -1;
-            }
+    while ((opt = getopt_long(argc, argv, "j:y", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'M':
+            use_mmap = 0;
+            break;
+        case 'C':
+            cache_blocks = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            show_stats = 1;
+            break;
+        case 'a':
+            report_all = 1;
+            break;
+        case 'y':
+            fix = report_all = 1;  // a repair needs every finding
+            break;
+        case 'B':
+            rebuild = 1;
+            break;
+        case 'K':
+            cache_path = optarg;
+            break;
+        case 'R':
+            replay_log = 1;
+            break;
+        case 'I':
+            install = 1;
+            break;
+        case 'L':
+            if (parse_size(optarg, &mem_limit) < 0) bad_usage = 1;
+            break;
+        case 'D':
+            batch_depth = strtoul(optarg, NULL, 10);
+            if (batch_depth > BATCH_MAX_DEPTH) bad_usage = 1;
+            break;
+        case 'F':
+            if (strcmp(optarg, "text") == 0) format = FORMAT_TEXT;
+            else if (strcmp(optarg, "json") == 0) format = FORMAT_JSON;
+            else if (strcmp(optarg, "ndjson") == 0) format = FORMAT_NDJSON;
+            else bad_usage = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) bad_usage = 1;
+            break;
+        default:
+            bad_usage = 1;
+            break;
         }
     }
 
-    free(referenced);
-    return 0;
-}
+    if (bad_usage || optind >= argc) {
+        printf("Usage: %s [-y] [--rebuild-bitmap] [-j N] [--all] [--format=text|json|ndjson] [--no-mmap] [--cache-blocks N] [--io-depth N] [--mem-limit BYTES] [--cache FILE] [--replay-log | --install-log] [--stats] DISKFILE.img|-\n", argv[0]);
+        printf("  -y: repair, then check again; exit 0 if nothing was wrong, 1 if every problem was fixed, 4 if some are left\n");
+        printf("  --stats: at exit, print I/O counters, time per phase and memory (peak RSS, reference map bytes) to stderr\n");
+        return 1;
+    }
 
+    // From here on every exit goes through fail_early or print_json, so
+    // --format=json and ndjson always write one document
+    double start = now_seconds();
 
+    // A repair would be undone when the kernel installs the log over it
+    if ((fix || rebuild) && replay_log) {
+        return fail_early(format, "Cannot repair with --replay-log; use --install-log", start);
+    }
 
+    addr_scan_init();
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s DISKFILE.img\n", argv[0]);
-        return 1;
+    if (strcmp(argv[optind], "-") == 0) {
+        if (fix || rebuild || install) {
+            return fail_early(format, "Cannot repair an image read from standard input", start);
+        }
+        if (stream_load(STDIN_FILENO) < 0) {
+            return fail_early(format, "ERROR: failed to read the image from standard input", start);
+        }
+    } else if (image_open(argv[optind], use_mmap, fix || rebuild || install) < 0) {
+        char msg[4096];
+        snprintf(msg, sizeof(msg), "ERROR: cannot open %s: %s", argv[optind], strerror(errno));
+        return fail_early(format, msg, start);
     }
-
-    fsfd = open(argv[1], O_RDONLY);
-    if (fsfd < 0) {
-        perror(argv[1]);
-        return 1;
+    // The cache only sits in front of pread; a mapping or a stream needs none
+    if (!img.map && !img.stream && cache_init(cache_blocks) < 0) {
+        return fail_early(format, "ERROR: out of memory", start);
     }
 
     // Read superblock
     char sbbuf[BSIZE];
     struct superblock sb;
     if (rblock(SUPERBLOCK, sbbuf) < 0) {
-        printf("Failed to read superblock\n");
-        close(fsfd);
-        return 1;
+        return fail_early(format, "Failed to read superblock", start);
     }
     memcpy(&sb, sbbuf, sizeof(sb));
 
     // Verify magic number
     if (sb.magic != FSMAGIC) {
-        printf("ERROR: bad magic number in superblock\n");
-        close(fsfd);
-        return 1;
+        return fail_early(format, "ERROR: bad magic number in superblock", start);
     }
 
-    // Check all inodes
-    if (check_all_inodes(&sb) < 0) {
-        close(fsfd);
-        return 1;
+    // A transaction committed to the log but not installed: check the image as
+    // it will be once it is, or install it first; otherwise just say so
+    struct logheader lh;
+    int log_ok = log_read(&sb, &lh) == 0;
+    if ((replay_log || install) && !log_ok) {
+        return fail_early(format, "ERROR: bad log header", start);
+    }
+    if (install && lh.n) {
+        int n = log_install(&sb, &lh);
+        if (n < 0) return fail_early(format, "ERROR: failed to install the log", start);
+        if (format == FORMAT_TEXT) printf("INSTALLED: %d blocks from the log\n", n);
+    } else if (replay_log && !img.stream && log_overlay(&sb, &lh) < 0) {
+        return fail_early(format, "ERROR: failed to read the log", start);
+    } else if (!replay_log && !install && log_ok && lh.n) {
+        fprintf(stderr, "%s: the log holds %d blocks not yet installed; "
+                "see --replay-log and --install-log\n", argv[0], lh.n);
     }
+    stats.phase[PHASE_SUPERBLOCK] = now_seconds() - start;
 
-    if (check_all_directory_formats(&sb) < 0) {
-        close(fsfd);
-        return 1;
+    // A repair works on the block maps, so they have to fit
+    if ((fix || rebuild) && mem_limit && block_maps_bytes(sb.size) > mem_limit) {
+        return fail_early(format, "ERROR: repair needs the block maps in memory; raise --mem-limit", start);
     }
-   
-    if (check_dirent_refers_to_allocated_inode(&sb) < 0) {
-        close(fsfd);
-        return 1;
+
+    // An image whose fingerprint hasn't changed since a clean run is still clean;
+    // otherwise only the inodes in changed regions are read again.
+    // Repairs need the model, so they always check in full.
+    struct fingerprint fp = { 0 };
+    struct prior_state prior;
+    memset(&prior, 0, sizeof(prior));
+    int have_fp = 0, skipped = 0;
+    if (cache_path && !fix && !rebuild) {
+        double t = now_seconds();
+        have_fp = fingerprint_image(&sb, &fp) == 0;
+        skipped = have_fp && fp_load(cache_path, &sb, &fp, &prior);
+        stats.phase[PHASE_FINGERPRINT] = now_seconds() - t;
     }
 
-    if (check_multiply_referenced_blocks(&sb) < 0) {
-        close(fsfd);
-        return 1;
+    // Scan the image once, then check the model
+    struct fsck_model model;
+    memset(&model, 0, sizeof(model));
+    if (!skipped && build_model(&sb, &model, nthreads, &prior) < 0) {
+        fp_free(&fp);
+        prior_free(&prior);
+        return fail_early(format, fatal_error ? fatal_error : "ERROR: failed to build the model", start);
     }
 
-    if (check_referenced_blocks(&sb) < 0) {
-        close(fsfd);
-        return 1;
+    model.report_all = report_all;
+    int status = !skipped && run_checks(&model) < 0 ? 1 : 0;
+    if (have_fp && !skipped) {
+        double t = now_seconds();
+        fp_save(cache_path, &sb, &fp, &model, status == 0);
+        stats.phase[PHASE_FINGERPRINT] += now_seconds() - t;
     }
+    int text = format == FORMAT_TEXT;
+    if (text) print_findings(&model);
 
-    if (check_used_inode_found_in_directory(&sb) < 0) {
-        close(fsfd);
-        return 1;
+    // -y repairs the bitmap along with everything else, then checks the
+    // written image again: 1 says every problem was fixed, 4 that some are left
+    double t = now_seconds();
+    if (fix && status) {
+        stats.blocks_written = repair(&model, text, &stats.fixes);
+        if (text && stats.blocks_written < 0) printf("ERROR: repair failed\n");
+        else if (text) printf("REPAIRED: %u fixes, %ld blocks written\n", stats.fixes, stats.blocks_written);
+        status = stats.blocks_written >= 0 && recheck(argv[optind], &sb, use_mmap, cache_blocks, nthreads) == 0 ? 1 : 4;
+        if (text && status == 4 && stats.blocks_written >= 0) printf("ERROR: problems are left after the repair\n");
+    } else if (rebuild && !fix) {
+        stats.blocks_written = rebuild_bitmap_only(&model, text, &stats.bits_flipped);
+        if (text && stats.blocks_written < 0) printf("ERROR: bitmap not rebuilt\n");
+        else if (text) printf("REBUILT: %lu bits flipped, %ld blocks written\n", stats.bits_flipped, stats.blocks_written);
     }
+    stats.phase[PHASE_REPAIR] = now_seconds() - t;
 
-    if (check_parent_directory_mismatch(&sb) < 0) {
-        close(fsfd);
-        return 1;
+    if (!text) {
+        print_json(&model, &model.findings, status, now_seconds() - start, format == FORMAT_NDJSON);
     }
 
-    close(fsfd);
-    return 0;
+    if (show_stats) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        size_t maps = ((size_t)model.inode_refs.nwords + model.block_refs.nwords +
+                       model.block_used.nwords) * sizeof(uint64);
+
+        fprintf(stderr, "backend: %s, address kernel: %s\n",
+                img.stream ? "stream" : img.map ? "mmap" : "pread", addr_kernel);
+        fprintf(stderr, "cache: %u blocks, %lu hits, %lu misses, %lu readahead\n",
+                cache.nslots, cache.hits, cache.misses, cache.readahead);
+        fprintf(stderr, "io: %lu bytes read, %lu syscalls\n", stats.bytes_read, stats.syscalls);
+        if (model.spilling) {
+            fprintf(stderr, "spill: %lu runs, %lu bytes\n", stats.spill_runs, stats.spill_bytes);
+        }
+        if (cache_path) {
+            fprintf(stderr, "fingerprint: %u regions, %u changed, %u inodes reused%s\n", fp.n, fp.changed,
+                    prior.reused, skipped ? ", check skipped" : "");
+        }
+        fprintf(stderr, "time: %.6f s", now_seconds() - start);
+        for (int i = 0; i < NPHASES; i++) {
+            fprintf(stderr, ", %s %.6f", phase_names[i], stats.phase[i]);
+        }
+        fprintf(stderr, "\n");
+        fprintf(stderr, "memory: peak RSS %ld KiB, reference maps %zu bytes\n", ru.ru_maxrss, maps);
+    }
+
+    fp_free(&fp);
+    free_model(&model);
+    prior_free(&prior);
+    cache_free();
+    image_close();
+    return status;
 }
@@ -4,43 +4,86 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct dirent hostdirent;  // before the xv6 struct dirent takes the name
 
 #define stat xv6_stat  // avoid clash with host struct stat
+#define dirent xv6_dirent  // and with host struct dirent
 #include "kernel/types.h"
 #include "kernel/fs.h"
 #include "kernel/stat.h"
 #include "kernel/param.h"
+#undef stat
 
 #ifndef static_assert
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
 #define NINODES 200
-
+#define NREADERS 4
+
+// The image is built in place in a shared mapping of the output file:
+// the file is sized with ftruncate, so blocks never written stay holes,
+// inodes and dirents are stored straight into the mapping, and the
+// kernel writes the pages back once when it is unmapped.
+//
+// Files are laid out as they are found: the inode, the directory entry
+// and every block are allocated up front from the size the host reports,
+// and a pool of reader threads then copies the contents into blocks that
+// are already theirs, so the allocator never needs a lock.
+//
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/BPB + 1;
-int ninodeblocks = NINODES / IPB + 1;
+uint fssize = FSSIZE;
+uint ninodes = NINODES;
+int nreaders = NREADERS;
+
+int nbitmap;
+int ninodeblocks;
 int nlog = LOGSIZE;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
+uchar *image;  // the mapped image, fssize blocks
+char *tmpimg;  // the image while it is built; renamed into place at the end
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
+// A file whose blocks are allocated and whose contents are still to be read
+struct job {
+  uint inum;
+  char *path;
+};
+
+struct job *jobs;
+uint njobs;
+uint jobcap;
+uint nextjob;  // next job for a reader to take
+int readfailed;
 
+
+uint balloc1(void);
 void balloc(int);
 void wsect(uint, void*);
-void winode(uint, struct dinode*);
-void rinode(uint inum, struct dinode *ip);
-void rsect(uint sec, void *buf);
+void *bptr(uint sec);
+struct dinode *iptr(uint inum);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void iextend(uint inum, uint size);
+void dirlink(uint dir, char *name, uint inum);
+uint makedir(uint parent, char *name);
+void addfile(uint dir, char *name, char *path);
+void importdir(uint dir, char *path);
+void readfiles(void);
 void die(const char *);
+void fail(void);
 
 // convert to riscv byte order
 ushort
@@ -65,68 +108,94 @@ xint(uint x)
   return y;
 }
 
+void
+usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-s size] [-i ninodes] [-d dir] [-j readers] fs.img files...\n", prog);
+  exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
-  char buf[BSIZE];
-  struct dinode din;
+  int i, opt;
+  uint rootino, off;
+  char *tree = 0;
+  struct dinode *din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  while((opt = getopt(argc, argv, "s:i:d:j:")) != -1){
+    switch(opt){
+    case 's': fssize = strtoul(optarg, 0, 0); break;
+    case 'i': ninodes = strtoul(optarg, 0, 0); break;
+    case 'd': tree = optarg; break;
+    case 'j': nreaders = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+    }
   }
+  if(optind >= argc || nreaders < 1)
+    usage(argv[0]);
+  argv += optind - 1;
+  argc -= optind - 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
-  if(fsfd < 0)
-    die(argv[1]);
-
   // 1 fs block = 1 disk sector
+  nbitmap = (fssize + BPB - 1) / BPB;
+  ninodeblocks = ninodes / IPB + 1;
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if(ninodes < 2 || fssize <= nmeta){
+    fprintf(stderr, "mkfs: %u blocks is too small for %u inodes\n", fssize, ninodes);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
+
+  // Built under a temporary name beside the output, so a failure never
+  // leaves a half-built image where a finished one is expected
+  tmpimg = malloc(strlen(argv[1]) + 8);
+  if(tmpimg == 0)
+    die("malloc");
+  sprintf(tmpimg, "%s.XXXXXX", argv[1]);
+  fsfd = mkstemp(tmpimg);
+  if(fsfd < 0){
+    perror(argv[1]);
+    exit(1);
+  }
+  mode_t mask = umask(0);
+  umask(mask);
+  if(fchmod(fsfd, 0666 & ~mask) < 0)
+    die(tmpimg);
+
+  // A fresh file of the right size reads as zeroes without writing any
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0)
+    die("ftruncate");
+  image = mmap(0, (size_t)fssize * BSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(image == MAP_FAILED)
+    die("mmap");
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
-  memset(buf, 0, sizeof(buf));
-  memmove(buf, &sb, sizeof(sb));
-  wsect(1, buf);
+  memmove(bptr(1), &sb, sizeof(sb));
 
-  rootino = ialloc(T_DIR);
+  rootino = makedir(0, 0);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
-
   for(i = 2; i < argc; i++){
     // get rid of "user/"
     char *shortname;
@@ -134,11 +203,11 @@ main(int argc, char *argv[])
       shortname = argv[i] + 5;
     else
       shortname = argv[i];
-    
-    assert(index(shortname, '/') == 0);
 
-    if((fd = open(argv[i], 0)) < 0)
-      die(argv[i]);
+    if(index(shortname, '/') != 0){
+      fprintf(stderr, "mkfs: %s: not a name in the current directory\n", argv[i]);
+      fail();
+    }
 
     // Skip leading _ in name when writing to file system.
     // The binaries are named _rm, _cat, etc. to keep the
@@ -147,157 +216,377 @@ main(int argc, char *argv[])
     if(shortname[0] == '_')
       shortname += 1;
 
-    assert(strlen(shortname) <= DIRSIZ);
-    
-    inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
-
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
-
-    close(fd);
+    addfile(rootino, shortname, argv[i]);
   }
 
+  if(tree)
+    importdir(rootino, tree);
+
   // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
+  din = iptr(rootino);
+  off = xint(din->size);
   off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  din->size = xint(off);
 
+  // A file that couldn't be read leaves the image partly populated
+  readfiles();
+  if(readfailed)
+    fail();
   balloc(freeblock);
 
+  // The one write-back of the whole image
+  if(munmap(image, (size_t)fssize * BSIZE) < 0)
+    die("munmap");
+  if(close(fsfd) < 0)
+    die("close");
+  if(rename(tmpimg, argv[1]) < 0)
+    die(argv[1]);
+
   exit(0);
 }
 
+// Creates a directory with "." and ".." in parent, or the root if
+// parent is 0. As in the kernel, ".." is a link to the parent.
+uint
+makedir(uint parent, char *name)
+{
+  struct dirent de;
+  struct dinode *pin;
+  uint inum = ialloc(T_DIR);
+
+  if(parent == 0)
+    parent = inum;  // the root is its own parent
+  else {
+    dirlink(parent, name, inum);
+    pin = iptr(parent);
+    pin->nlink = xshort(xshort(pin->nlink) + 1);
+  }
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strcpy(de.name, ".");
+  iappend(inum, &de, sizeof(de));
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(parent);
+  strcpy(de.name, "..");
+  iappend(inum, &de, sizeof(de));
+
+  return inum;
+}
+
 void
-wsect(uint sec, void *buf)
+dirlink(uint dir, char *name, uint inum)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  struct dirent de;
+
+  if(strlen(name) > DIRSIZ){
+    fprintf(stderr, "mkfs: %s: name longer than %d characters\n", name, DIRSIZ);
+    fail();
+  }
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+  iappend(dir, &de, sizeof(de));
 }
 
+// Links the host file at path into dir and allocates its blocks;
+// a reader fills them in later.
 void
-winode(uint inum, struct dinode *ip)
+addfile(uint dir, char *name, char *path)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  struct stat st;
+  uint inum;
+
+  if(stat(path, &st) < 0)
+    die(path);
+  if(st.st_size > MAXFILE * BSIZE){
+    fprintf(stderr, "mkfs: %s: larger than %d bytes\n", path, (int)(MAXFILE * BSIZE));
+    fail();
+  }
+
+  inum = ialloc(T_FILE);
+  dirlink(dir, name, inum);
+  iextend(inum, st.st_size);
+
+  if(njobs == jobcap){
+    jobcap = jobcap ? jobcap * 2 : 64;
+    jobs = realloc(jobs, jobcap * sizeof(struct job));
+    if(jobs == 0)
+      die("malloc");
+  }
+  jobs[njobs].inum = inum;
+  jobs[njobs].path = strdup(path);
+  if(jobs[njobs].path == 0)
+    die("malloc");
+  njobs++;
+}
+
+// Imports the host directory at path into dir: subdirectories become
+// directories and regular files become files, in name order so the
+// same tree always gives the same image. Anything else is skipped.
+void
+importdir(uint dir, char *path)
+{
+  hostdirent **names;
+  struct stat st;
+  char *name, *sub;
+  int i, n;
+
+  n = scandir(path, &names, 0, alphasort);
+  if(n < 0)
+    die(path);
+
+  for(i = 0; i < n; i++){
+    name = names[i]->d_name;
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      goto next;
+
+    sub = malloc(strlen(path) + strlen(name) + 2);
+    if(sub == 0)
+      die("malloc");
+    sprintf(sub, "%s/%s", path, name);
+    if(lstat(sub, &st) < 0)
+      die(sub);
+
+    if(S_ISDIR(st.st_mode))
+      importdir(makedir(dir, name), sub);
+    else if(S_ISREG(st.st_mode))
+      addfile(dir, name, sub);
+    else
+      fprintf(stderr, "mkfs: %s: not a file or directory, skipped\n", sub);
+    free(sub);
+  next:
+    free(names[i]);
+  }
+  free(names);
+}
+
+// The block that holds byte fbn * BSIZE of a file
+uint
+fileblock(struct dinode *din, uint fbn)
+{
+  uint *indirect;
+
+  if(fbn < NDIRECT)
+    return xint(din->addrs[fbn]);
+  indirect = bptr(xint(din->addrs[NDIRECT]));
+  return xint(indirect[fbn - NDIRECT]);
+}
+
+// Copies one file into its blocks, a run of consecutive blocks per read.
+// Returns 0, or -1 if the file could not be read or has changed size.
+int
+readfile(struct job *j)
+{
+  struct dinode *din = iptr(j->inum);
+  uint size = xint(din->size);
+  uint fbn, nb, start, run;
+  ssize_t n, want;
+  int fd;
+
+  fd = open(j->path, O_RDONLY);
+  if(fd < 0){
+    perror(j->path);
+    return -1;
+  }
+  nb = (size + BSIZE - 1) / BSIZE;
+  for(fbn = 0; fbn < nb; fbn += run){
+    start = fileblock(din, fbn);
+    for(run = 1; fbn + run < nb && fileblock(din, fbn + run) == start + run; run++)
+      ;
+    want = (fbn + run) * BSIZE < size ? run * BSIZE : size - fbn * BSIZE;
+    n = pread(fd, bptr(start), want, (off_t)fbn * BSIZE);
+    if(n != want){
+      fprintf(stderr, "mkfs: %s: changed while being read\n", j->path);
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+void*
+reader(void *arg)
+{
+  uint i;
+
+  while((i = __atomic_fetch_add(&nextjob, 1, __ATOMIC_RELAXED)) < njobs){
+    if(readfile(&jobs[i]) < 0)
+      __atomic_store_n(&readfailed, 1, __ATOMIC_RELAXED);
+  }
+  return 0;
 }
 
+// Reads every file into the image with nreaders threads
 void
-rinode(uint inum, struct dinode *ip)
+readfiles(void)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  pthread_t *threads;
+  int i, started;
+
+  threads = malloc(nreaders * sizeof(pthread_t));
+  if(threads == 0)
+    die("malloc");
+  for(started = 0; started < nreaders; started++){
+    if(pthread_create(&threads[started], 0, reader, 0) != 0)
+      break;
+  }
+  if(started == 0)
+    reader(0);
+  for(i = 0; i < started; i++)
+    pthread_join(threads[i], 0);
+  free(threads);
+
+  for(i = 0; i < njobs; i++)
+    free(jobs[i].path);
+  free(jobs);
+}
+
+// The block in the mapped image
+void*
+bptr(uint sec)
+{
+  assert(sec < fssize);
+  return image + (size_t)sec * BSIZE;
+}
+
+struct dinode*
+iptr(uint inum)
+{
+  assert(inum < ninodes);
+  return (struct dinode*)bptr(IBLOCK(inum, sb)) + (inum % IPB);
 }
 
 void
-rsect(uint sec, void *buf)
+wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  memmove(bptr(sec), buf, BSIZE);
 }
 
 uint
 ialloc(ushort type)
 {
   uint inum = freeinode++;
-  struct dinode din;
+  struct dinode *din;
 
-  bzero(&din, sizeof(din));
-  din.type = xshort(type);
-  din.nlink = xshort(1);
-  din.size = xint(0);
-  winode(inum, &din);
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes\n");
+    fail();
+  }
+  din = iptr(inum);
+  bzero(din, sizeof(*din));
+  din->type = xshort(type);
+  din->nlink = xshort(1);
+  din->size = xint(0);
   return inum;
 }
 
+uint
+balloc1(void)
+{
+  if(freeblock >= fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    fail();
+  }
+  return freeblock++;
+}
+
+// Marks the first used blocks allocated, across as many bitmap blocks as it takes
 void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int b, i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BPB);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used <= nbitmap * BPB);
+  for(b = 0; b < nbitmap; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b * BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", xint(sb.bmapstart) + b);
+    wsect(xint(sb.bmapstart) + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Appends straight into the mapped image: the inode, the indirect
+// block and the data blocks are all updated in place.
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
   uint fbn, off, n1;
-  struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  struct dinode *din = iptr(inum);
+  uint *indirect;
   uint x;
 
-  rinode(inum, &din);
-  off = xint(din.size);
+  off = xint(din->size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
     if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
+      if(xint(din->addrs[fbn]) == 0){
+        din->addrs[fbn] = xint(balloc1());
       }
-      x = xint(din.addrs[fbn]);
+      x = xint(din->addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      if(xint(din->addrs[NDIRECT]) == 0){
+        din->addrs[NDIRECT] = xint(balloc1());
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      indirect = bptr(xint(din->addrs[NDIRECT]));
       if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+        indirect[fbn - NDIRECT] = xint(balloc1());
       }
       x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    memmove((char*)bptr(x) + off - (fbn * BSIZE), p, n1);
     n -= n1;
     off += n1;
     p += n1;
   }
-  din.size = xint(off);
-  winode(inum, &din);
+  din->size = xint(off);
+}
+
+// Grows an empty file to size bytes, allocating its blocks in the
+// order iappend would but leaving their contents to a reader.
+void
+iextend(uint inum, uint size)
+{
+  struct dinode *din = iptr(inum);
+  uint *indirect;
+  uint fbn, nb = (size + BSIZE - 1) / BSIZE;
+
+  assert(xint(din->size) == 0 && nb <= MAXFILE);
+  for(fbn = 0; fbn < nb && fbn < NDIRECT; fbn++)
+    din->addrs[fbn] = xint(balloc1());
+  if(nb > NDIRECT){
+    din->addrs[NDIRECT] = xint(balloc1());
+    indirect = bptr(xint(din->addrs[NDIRECT]));
+    for(; fbn < nb; fbn++)
+      indirect[fbn - NDIRECT] = xint(balloc1());
+  }
+  din->size = xint(size);
+}
+
+// Removes the half-built image, if there is one, and exits
+void
+fail(void)
+{
+  if(tmpimg)
+    unlink(tmpimg);
+  exit(1);
 }
 
 void
 die(const char *s)
 {
   perror(s);
-  exit(1);
+  fail();
 }
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define stat xv6_stat  // avoid clash with host struct stat
+#include "kernel/types.h"
+#include "kernel/fs.h"
+#include "kernel/stat.h"
+
+#define DPB (BSIZE / sizeof(struct dirent))  // directory entries per block
+
+// Damages one field of an xv6 image for the regression tests.  Inodes
+// are named by path and block numbers may be given as PATH:addrN, so a
+// test reads the same whatever numbers mkfs happened to hand out.
+// Like chkfs, the image is taken to be in host (little-endian) order.
+// With -l the writes are committed to the log instead, as if the
+// system had crashed before installing them.
+
+// The log header at sb.logstart, as the kernel writes it
+struct logheader {
+  int n;
+  int block[BSIZE / sizeof(int) - 1];
+};
+
+int fsfd;
+struct superblock sb;
+uint seed;
+int logging;
+struct logheader lh;
+
+void
+die(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+void
+fail(const char *what, const char *arg)
+{
+  fprintf(stderr, "corrupt: %s: %s\n", what, arg);
+  exit(1);
+}
+
+// The log slot holding block b, or -1
+int
+logslot(uint b)
+{
+  int i;
+
+  for(i = 0; i < lh.n; i++)
+    if(lh.block[i] == b)
+      return i;
+  return -1;
+}
+
+void
+rblock(uint b, void *buf)
+{
+  int i;
+
+  if(logging && (i = logslot(b)) >= 0)
+    b = sb.logstart + 1 + i;
+  if(pread(fsfd, buf, BSIZE, (off_t)b * BSIZE) != BSIZE)
+    die("read");
+}
+
+void
+wblock(uint b, void *buf)
+{
+  int i;
+
+  if(logging){
+    if((i = logslot(b)) < 0){
+      if(lh.n + 1 >= sb.nlog)
+        fail("log full", "-l");
+      i = lh.n++;
+      lh.block[i] = b;
+    }
+    b = sb.logstart + 1 + i;
+  }
+  if(pwrite(fsfd, buf, BSIZE, (off_t)b * BSIZE) != BSIZE)
+    die("write");
+}
+
+void
+rinode(uint inum, struct dinode *ip)
+{
+  char buf[BSIZE];
+
+  rblock(IBLOCK(inum, sb), buf);
+  *ip = ((struct dinode*)buf)[inum % IPB];
+}
+
+void
+winode(uint inum, struct dinode *ip)
+{
+  char buf[BSIZE];
+
+  rblock(IBLOCK(inum, sb), buf);
+  ((struct dinode*)buf)[inum % IPB] = *ip;
+  wblock(IBLOCK(inum, sb), buf);
+}
+
+// The block holding byte off of the inode, or 0 for a hole
+uint
+bmap(struct dinode *ip, uint off)
+{
+  uint fbn = off / BSIZE, ind[NINDIRECT];
+
+  if(fbn < NDIRECT)
+    return ip->addrs[fbn];
+  if(fbn >= MAXFILE || ip->addrs[NDIRECT] == 0)
+    return 0;
+  rblock(ip->addrs[NDIRECT], ind);
+  return ind[fbn - NDIRECT];
+}
+
+// Finds name in directory dir; returns the entry's block and slot
+int
+dirlookup(uint dir, char *name, uint *bp, uint *slot)
+{
+  struct dinode din;
+  struct dirent de[DPB];
+  uint off, b;
+
+  rinode(dir, &din);
+  if(din.type != T_DIR)
+    return 0;
+  for(off = 0; off < din.size; off += BSIZE){
+    if((b = bmap(&din, off)) == 0)
+      continue;
+    rblock(b, de);
+    for(*slot = 0; *slot < DPB; (*slot)++){
+      if(de[*slot].inum != 0 && strncmp(de[*slot].name, name, DIRSIZ) == 0){
+        *bp = b;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+uint
+namei(char *path)
+{
+  char copy[512], *name;
+  uint inum = ROOTINO, b, slot;
+  struct dirent de[DPB];
+
+  snprintf(copy, sizeof(copy), "%s", path);
+  for(name = strtok(copy, "/"); name; name = strtok(0, "/")){
+    if(!dirlookup(inum, name, &b, &slot))
+      fail("no such path", path);
+    rblock(b, de);
+    inum = de[slot].inum;
+  }
+  return inum;
+}
+
+// addrN names addrs[N]; returns a pointer into the inode
+uint*
+addrfield(struct dinode *ip, char *field)
+{
+  char *end;
+  long n;
+
+  if(strncmp(field, "addr", 4) != 0)
+    return 0;
+  n = strtol(field + 4, &end, 10);
+  if(end == field + 4 || *end != 0 || n < 0 || n > NDIRECT)
+    return 0;
+  return &ip->addrs[n];
+}
+
+// A number, or PATH:addrN for the address held by another inode
+uint
+value(char *arg)
+{
+  char path[512], *colon, *end;
+  struct dinode din;
+  uint *a, v;
+
+  if((colon = strrchr(arg, ':')) == 0){
+    v = strtoul(arg, &end, 0);
+    if(end == arg || *end != 0)
+      fail("not a number", arg);
+    return v;
+  }
+  snprintf(path, sizeof(path), "%.*s", (int)(colon - arg), arg);
+  rinode(namei(path), &din);
+  if((a = addrfield(&din, colon + 1)) == 0)
+    fail("not an address field", colon + 1);
+  return *a;
+}
+
+// xorshift32: the same seed gives the same damage
+uint
+rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+// A random inode in use, of the given type if type is nonzero
+uint
+rndinode(struct dinode *ip, int type)
+{
+  uint inum, tries;
+
+  for(tries = 0; tries < 1000000; tries++){
+    inum = 1 + rnd() % (sb.ninodes - 1);
+    rinode(inum, ip);
+    if(ip->type != 0 && (type == 0 || ip->type == type))
+      return inum;
+  }
+  fail("no inode in use", "random");
+  return 0;
+}
+
+// Sets one random byte of the metadata chkfs reads: an inode in use,
+// the used part of a directory block, or the bitmap
+void
+damage(void)
+{
+  struct dinode din;
+  uchar buf[BSIZE];
+  uint inum, b, off, n, v;
+
+  v = rnd() % 256;
+  switch(rnd() % 3){
+  case 0:
+    inum = rndinode(&din, 0);
+    off = rnd() % sizeof(din);
+    ((uchar*)&din)[off] = v;
+    winode(inum, &din);
+    printf("inode %u byte %u = %u\n", inum, off, v);
+    return;
+  case 1:
+    inum = rndinode(&din, T_DIR);
+    if(din.size == 0)
+      break;
+    off = rnd() % din.size;
+    if((b = bmap(&din, off)) == 0 || b >= sb.size)
+      break;
+    rblock(b, buf);
+    buf[off % BSIZE] = v;
+    wblock(b, buf);
+    printf("directory %u byte %u = %u\n", inum, off, v);
+    return;
+  }
+  n = (sb.size + 7) / 8;
+  off = rnd() % n;
+  b = sb.bmapstart + off / BSIZE;
+  rblock(b, buf);
+  buf[off % BSIZE] = v;
+  wblock(b, buf);
+  printf("bitmap byte %u = %u\n", off, v);
+}
+
+void
+usage(char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [-l] fs.img set PATH type|nlink|size|addrN VALUE\n"
+          "       %s fs.img dirent DIR NAME INUM|PATH\n"
+          "       %s fs.img link DIR NAME PATH\n"
+          "       %s fs.img bit BLOCK 0|1\n"
+          "       %s fs.img random SEED\n"
+          "VALUE and BLOCK may be PATH:addrN\n", prog, prog, prog, prog, prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct dinode din;
+  struct dirent de[DPB];
+  uint inum, b, slot, off, n, *a;
+  uchar buf[BSIZE];
+  char *op;
+  size_t len;
+
+  if(argc > 1 && strcmp(argv[1], "-l") == 0){
+    logging = 1;
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+  }
+  if(argc < 3)
+    usage(argv[0]);
+  if((fsfd = open(argv[1], O_RDWR)) < 0)
+    die(argv[1]);
+  rblock(1, buf);
+  memmove(&sb, buf, sizeof(sb));
+  if(sb.magic != FSMAGIC)
+    fail("not an xv6 image", argv[1]);
+  if(logging){
+    // Only a log with nothing pending can take a new transaction
+    rblock(sb.logstart, buf);
+    if(sb.nlog < 2 || ((struct logheader*)buf)->n != 0)
+      fail("log not empty", argv[1]);
+  }
+
+  op = argv[2];
+  if(strcmp(op, "set") == 0 && argc == 6){
+    inum = namei(argv[3]);
+    rinode(inum, &din);
+    if(strcmp(argv[4], "type") == 0)
+      din.type = value(argv[5]);
+    else if(strcmp(argv[4], "nlink") == 0)
+      din.nlink = value(argv[5]);
+    else if(strcmp(argv[4], "size") == 0)
+      din.size = value(argv[5]);
+    else if((a = addrfield(&din, argv[4])) != 0)
+      *a = value(argv[5]);
+    else
+      usage(argv[0]);
+    winode(inum, &din);
+  } else if(strcmp(op, "dirent") == 0 && argc == 6){
+    // 0 clears the entry, leaving whatever it named unreferenced
+    inum = argv[5][0] == '/' ? namei(argv[5]) : value(argv[5]);
+    if(!dirlookup(namei(argv[3]), argv[4], &b, &slot))
+      fail("no such entry", argv[4]);
+    rblock(b, de);
+    de[slot].inum = inum;
+    wblock(b, de);
+  } else if(strcmp(op, "link") == 0 && argc == 6){
+    // Adds a name in a free slot, or just past the end of the last
+    // block, without touching any link count
+    if((len = strlen(argv[4])) > DIRSIZ)
+      fail("name too long", argv[4]);
+    inum = namei(argv[3]);
+    rinode(inum, &din);
+    for(off = 0; off < din.size; off += sizeof(de[0])){
+      if((b = bmap(&din, off)) == 0)
+        continue;
+      rblock(b, de);
+      if(de[off % BSIZE / sizeof(de[0])].inum == 0)
+        break;
+    }
+    if(off == din.size){
+      if(off % BSIZE == 0 || (b = bmap(&din, off)) == 0)
+        fail("directory has no free slot", argv[3]);
+      din.size += sizeof(de[0]);
+      winode(inum, &din);
+      rblock(b, de);
+    }
+    slot = off % BSIZE / sizeof(de[0]);
+    memset(&de[slot], 0, sizeof(de[slot]));
+    de[slot].inum = namei(argv[5]);
+    memcpy(de[slot].name, argv[4], len);
+    wblock(b, de);
+  } else if(strcmp(op, "bit") == 0 && argc == 5){
+    b = value(argv[3]);
+    if(b >= sb.size)
+      fail("block out of range", argv[3]);
+    rblock(BBLOCK(b, sb), buf);
+    if(value(argv[4]))
+      buf[b % BPB / 8] |= 1 << (b % 8);
+    else
+      buf[b % BPB / 8] &= ~(1 << (b % 8));
+    wblock(BBLOCK(b, sb), buf);
+  } else if(strcmp(op, "random") == 0 && argc == 4){
+    // A few rounds first, so that nearby seeds damage unrelated places
+    if((seed = strtoul(argv[3], 0, 0)) == 0)
+      usage(argv[0]);
+    for(n = 0; n < 8; n++)
+      rnd();
+    damage();
+  } else {
+    usage(argv[0]);
+  }
+  if(logging){
+    // The commit point: the data is already in place
+    memset(buf, 0, sizeof(buf));
+    memmove(buf, &lh, sizeof(lh));
+    logging = 0;
+    wblock(sb.logstart, buf);
+  }
+  close(fsfd);
+  return 0;
+}